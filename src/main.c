@@ -1,12 +1,45 @@
+#include <cairo/cairo-pdf.h>
+#include <cairo/cairo-svg.h>
 #include <cairo/cairo.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <gtk/gtk.h>
 #include <math.h>
+#include <pango/pangocairo.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
 
 #define M_PI 3.14159265358979323846
+#define LOAD_BATCH 65536
+#define READ_SIZE (1 << 20)
+#define BLOCK_SIZE (16 << 20)
+#define N_BLOCKS 3
+#define WRITE_BATCH (1 << 20)
+#define EXPORT_MARGIN 100
+#define EXPORT_TILE 2048
+#define EXPORT_BUDGET (32 << 20)
+#define EXPORT_PAGE_WIDTH 1600
+#define EXPORT_PAGE_HEIGHT 1200
+#define BENCH_OPS 1000
+#define BENCH_GROWTH 16
+#define PAN_TIME 60000.0
+#define MINIMAP_SIZE 200
+#define MINIMAP_STRIPS 16
+#define MINIMAP_BUDGET 4000
+#define TRACE_EVENTS 65536
+#define TRACE_FILE "trace.json"
 #define SIGNAL_CONNECT(widget, signal, callback, data)                         \
   g_signal_connect(widget, signal, G_CALLBACK(callback), data)
 
@@ -21,16 +54,48 @@ typedef struct Node {
   char *name;
   struct Node **children;
   int n_children;
+  int children_size;
   Rectangle rect;
   bool selected;
   int id;
   struct Node *parent;
+  int index;
+  int stale_from; // Children from here on may have an index too high.
   char *filename;
   int color;
+  char *mount;
+  bool mount_loaded;
+  bool mount_dirty;
+  PangoLayout *layout;
+  double text_width;
+  double text_font_size;
+  double subtree_height;
+  Rectangle subtree_rect;
+  int n_descendents;
+  int *offsets;
+  int offsets_size;
+  bool offsets_dirty;
+  int preorder;
+  int map_slot;
+  bool map_expanded;
+  bool size_dirty;
 } Node;
 
+/*
+ * Node names and filenames are interned: equal strings share one
+ * reference-counted copy, so a tree with thousands of "TODO" nodes stores
+ * the text once. Each field holds a reference given back with release.
+ */
+typedef struct Interned {
+  int refs;
+  char str[];
+} Interned;
+
 typedef struct Tree {
   Node *root;
+  GHashTable *nodes;
+  int next_id;
+  bool detached; // Built by a worker thread and never shown, like a reload.
 } Tree;
 
 typedef enum Color {
@@ -46,49 +111,221 @@ typedef enum Scheme {
   SCHEME_DARK,
 } Scheme;
 
+typedef enum LayoutStyle {
+  LAYOUT_STACKED,
+  LAYOUT_TIDY,
+  LAYOUT_TOP_DOWN,
+  LAYOUT_RADIAL,
+  N_LAYOUT_STYLES,
+} LayoutStyle;
+
 typedef struct string {
   char *str;
   int len;
   int size;
 } string;
 
-GtkWidget *drawing_area;
+typedef struct NodeList {
+  Node **nodes;
+  int len;
+  int size;
+} NodeList;
+
+/*
+ * A window onto the shared tree. Node geometry is laid out once for all
+ * views, so a view only keeps its own root, position, zoom and input state.
+ */
+typedef struct View {
+  Tree *tree;
+  GtkWidget *drawing_area;
+  Node *draw_root;
+  double x_offset;
+  double y_offset;
+  double target_x_offset;
+  double target_y_offset;
+  double zoom;
+  guint frame_tick;
+  gint64 last_frame_time;
+  bool dragging;
+  bool banding;
+  double mouse_x;
+  double mouse_y;
+  double click_pos_x;
+  double click_pos_y;
+  bool side_panel_visible;
+  bool minimap_visible;
+} View;
+
+GPtrArray *views = NULL;
+View *view = NULL;
 double font_size = 10;
-Node *draw_root;
+double max_text_width = 0;
+PangoFontDescription *text_font = NULL;
+GPrivate text_context = G_PRIVATE_INIT(g_object_unref);
+Node *selected_node = NULL;
+GHashTable *marked = NULL;
+NodeList preorder = {NULL, 0, 0};
+NodeList loaded_mounts = {NULL, 0, 0};
+int preorder_version = -1;
+int structure_version = 0;
 double connector_radius = 4;
 Scheme color_scheme = SCHEME_DARK;
-double x_offset = 0;
-double y_offset = 0;
+LayoutStyle layout_style = LAYOUT_STACKED;
 int current_hash = 0;
+int edit_version = 0;
+int saved_version = 0;
 char *filename = NULL;
-bool dragging = false;
-double mouse_x = 0;
-double mouse_y = 0;
-double click_pos_x = 0;
-double click_pos_y = 0;
-bool side_panel_visible = false;
+char *import_source = NULL;
 double xpad;
 double ypad;
 double xmargin;
 double ymargin;
 bool slim_mode = false;
+bool read_only = false;
+bool loading = false;
+int load_permille = 0;
+int redraw_pending = 0;
+GRecMutex tree_lock;
+bool layout_dirty = true;
+bool layout_full = false;
+Node *layout_root = NULL;
+Rectangle layout_extent = {0, 0, 0, 0};
+int layout_version = 0;
+int layout_structure = -1;
+cairo_surface_t *minimap = NULL;
+int minimap_version = -1;
+Scheme minimap_scheme = SCHEME_DARK;
+int minimap_strips_done = 0;
+double minimap_scale = 1;
+double layout_font_size = 0;
+bool reloading = false;
+bool reload_queued = false;
+Tree *reload_base = NULL; // The file as the last reload read it.
+int reload_base_hash = 0;
+GFileMonitor *file_monitor = NULL;
+GHashTable *interned = NULL;
+GMutex intern_lock;
+gssize string_bytes = 0;
+gssize string_refs = 0;
+gssize live_nodes = 0;
+gssize child_bytes = 0;
+gssize offset_bytes = 0;
+gssize live_layouts = 0;
+
+/*
+ * With -DTRACE (make TRACE=1), timed spans go into a ring buffer that holds
+ * the last TRACE_EVENTS events and is written out as Chrome trace-event JSON
+ * on exit or with T. Without it the macros expand to nothing.
+ */
+#ifdef TRACE
+typedef struct TraceEvent {
+  const char *name;
+  const char *detail;
+  gint64 start;
+  gint64 duration;
+  int thread;
+  gint seq; // 2n + 2 once event n is complete, odd while it is written.
+} TraceEvent;
+
+TraceEvent trace_events[TRACE_EVENTS];
+gint trace_count = 0;
+gint trace_threads = 0;
+GPrivate trace_thread;
+
+#define TRACE_BEGIN(start) gint64 start = g_get_monotonic_time()
+#define TRACE_END(start, name, detail) trace_event(name, detail, start)
+
+void trace_event(const char *name, const char *detail, gint64 start) {
+  int thread = GPOINTER_TO_INT(g_private_get(&trace_thread));
+  if (thread == 0) {
+    thread = g_atomic_int_add(&trace_threads, 1) + 1;
+    g_private_set(&trace_thread, GINT_TO_POINTER(thread));
+  }
+
+  guint n = g_atomic_int_add(&trace_count, 1);
+  TraceEvent *event = &trace_events[n % TRACE_EVENTS];
+  g_atomic_int_set(&event->seq, 2 * n + 1);
+  event->name = name;
+  event->detail = detail;
+  event->start = start;
+  event->duration = g_get_monotonic_time() - start;
+  event->thread = thread;
+  g_atomic_int_set(&event->seq, 2 * n + 2);
+}
+
+/*
+ * Writes the buffered events, oldest first. Names and details are static
+ * strings that need no escaping. Other threads may be writing while this
+ * runs, so an event is copied and kept only if its slot held that same
+ * complete event before and after the copy.
+ */
+bool dump_trace(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    printf("Could not open %s\n", path);
+    return false;
+  }
+
+  guint count = g_atomic_int_get(&trace_count);
+  guint first = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+  guint written = 0;
+  fprintf(file, "{\"traceEvents\":[");
+  for (guint i = first; i < count; i++) {
+    TraceEvent *slot = &trace_events[i % TRACE_EVENTS];
+    gint seq = (gint)(2 * i + 2);
+    if (g_atomic_int_get(&slot->seq) != seq) {
+      continue;
+    }
+    TraceEvent event = *slot;
+    if (g_atomic_int_get(&slot->seq) != seq) {
+      continue;
+    }
+
+    fprintf(file,
+            "%s\n{\"name\":\"%s%s%s\",\"ph\":\"X\",\"ts\":%lld,"
+            "\"dur\":%lld,\"pid\":%d,\"tid\":%d}",
+            written > 0 ? "," : "", event.name, event.detail ? " " : "",
+            event.detail ? event.detail : "", (long long)event.start,
+            (long long)event.duration, (int)getpid(), event.thread);
+    written++;
+  }
+  fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(file);
+
+  printf("Wrote %u trace events to %s\n", written, path);
+  return true;
+}
+
+void dump_trace_at_exit() {
+  dump_trace(TRACE_FILE);
+}
+#else
+#define TRACE_BEGIN(start)
+#define TRACE_END(start, name, detail)
+#endif
 
-void set_style_slim(cairo_t *cr) {
+void set_style_slim() {
   xpad = 5;
   ypad = 5;
   xmargin = 50;
   ymargin = 5;
   font_size = 10;
-  cairo_set_font_size(cr, font_size);
 }
 
-void set_style_normal(cairo_t *cr) {
+void set_style_normal() {
   xpad = 10;
   ypad = 10;
   xmargin = 100;
   ymargin = 10;
   font_size = 12;
-  cairo_set_font_size(cr, font_size);
+}
+
+void set_style() {
+  if (slim_mode) {
+    set_style_slim();
+  } else {
+    set_style_normal();
+  }
 }
 
 void set_color(cairo_t *cr, Color color, double alpha) {
@@ -131,375 +368,3561 @@ void set_color(cairo_t *cr, Color color, double alpha) {
   }
 }
 
-Node *create_node(int id) {
-  Node *node = malloc(sizeof(Node));
-  node->name = strdup("New Node");
-  node->children = NULL;
-  node->n_children = 0;
-  node->rect = (Rectangle){0, 0, 0, 0};
-  node->selected = false;
-  node->parent = NULL;
-  node->id = id;
-  node->filename = NULL;
-  node->color = 0;
-  return node;
+void append_node(NodeList *list, Node *node) {
+  if (list->len == list->size) {
+    list->size = list->size == 0 ? 64 : list->size * 2;
+    list->nodes = realloc(list->nodes, list->size * sizeof(Node *));
+    if (list->nodes == NULL) {
+      printf("Could not allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  list->nodes[list->len++] = node;
 }
 
-Node *find_node(Node *node, int id) {
-  if (node->id == id) {
-    return node;
+GThreadPool *worker_pool = NULL;
+
+typedef struct ParallelJob {
+  void (*func)(void *item, void *data);
+  void *data;
+  GMutex mutex;
+  GCond cond;
+  int pending;
+} ParallelJob;
+
+typedef struct ParallelTask {
+  ParallelJob *job;
+  void *item;
+} ParallelTask;
+
+void run_parallel_task(gpointer data, gpointer user_data) {
+  (void)user_data;
+
+  ParallelTask *task = (ParallelTask *)data;
+  ParallelJob *job = task->job;
+  job->func(task->item, job->data);
+
+  g_mutex_lock(&job->mutex);
+  job->pending--;
+  if (job->pending == 0) {
+    g_cond_signal(&job->cond);
   }
+  g_mutex_unlock(&job->mutex);
+}
 
-  for (int i = 0; i < node->n_children; i++) {
-    Node *found = find_node(node->children[i], id);
-    if (found != NULL) {
-      return found;
-    }
+/*
+ * Calls func on every item using the shared worker pool and waits for all of
+ * them to finish. Idle workers pull the next queued item, so uneven items are
+ * balanced across threads. Must not be called from a pool thread.
+ */
+void run_parallel(void (*func)(void *, void *), void **items, int n_items,
+                  void *data) {
+  if (worker_pool == NULL) {
+    worker_pool = g_thread_pool_new(run_parallel_task, NULL,
+                                    g_get_num_processors(), FALSE, NULL);
   }
 
-  return NULL;
+  ParallelJob job;
+  job.func = func;
+  job.data = data;
+  job.pending = n_items;
+  g_mutex_init(&job.mutex);
+  g_cond_init(&job.cond);
+
+  ParallelTask *tasks = malloc(n_items * sizeof(ParallelTask));
+  for (int i = 0; i < n_items; i++) {
+    tasks[i] = (ParallelTask){&job, items[i]};
+    g_thread_pool_push(worker_pool, &tasks[i], NULL);
+  }
+
+  g_mutex_lock(&job.mutex);
+  while (job.pending > 0) {
+    g_cond_wait(&job.cond, &job.mutex);
+  }
+  g_mutex_unlock(&job.mutex);
+
+  g_mutex_clear(&job.mutex);
+  g_cond_clear(&job.cond);
+  free(tasks);
 }
 
-Tree *create_tree() {
-  Tree *tree = malloc(sizeof(Tree));
-  tree->root = create_node(0);
-  tree->root->name = strdup("root");
-  draw_root = tree->root;
-  return tree;
+Interned *interned_entry(char *str) {
+  return (Interned *)(str - offsetof(Interned, str));
 }
 
-void add_child(Node *node, Node *child) {
-  node->n_children++;
-  node->children = realloc(node->children, node->n_children * sizeof(Node *));
-  if (node->children == NULL) {
+// Returns the shared copy of text, adding a reference. Only a new string is
+// copied.
+char *intern(const char *text) {
+  g_mutex_lock(&intern_lock);
+  if (interned == NULL) {
+    interned = g_hash_table_new(g_str_hash, g_str_equal);
+  }
+  char *found = g_hash_table_lookup(interned, text);
+  if (found != NULL) {
+    interned_entry(found)->refs++;
+  } else {
+    size_t len = strlen(text);
+    Interned *entry = malloc(sizeof(Interned) + len + 1);
+    if (entry == NULL) {
+      printf("Could not allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(entry->str, text, len + 1);
+    entry->refs = 1;
+    g_hash_table_add(interned, entry->str);
+    string_bytes += sizeof(Interned) + len + 1;
+    found = entry->str;
+  }
+  string_refs++;
+  g_mutex_unlock(&intern_lock);
+  return found;
+}
+
+// Interns the first len bytes of text, ending them on the stack when short.
+char *intern_len(const char *text, size_t len) {
+  char small[256];
+  char *key = len < sizeof(small) ? small : malloc(len + 1);
+  if (key == NULL) {
     printf("Could not allocate memory\n");
     exit(EXIT_FAILURE);
   }
+  memcpy(key, text, len);
+  key[len] = '\0';
 
-  node->children[node->n_children - 1] = child;
-}
-
-char *get_name(char *line) {
-  char *name = strchr(line, '\t');
-  name = strchr(name + 1, '\t');
-  return name + 1;
+  char *str = intern(key);
+  if (key != small) {
+    free(key);
+  }
+  return str;
 }
 
-void remove_child(Node *node, Node *child) {
-  for (int i = 0; i < node->n_children; i++) {
-    if (node->children[i] == child) {
-      for (int j = i; j < node->n_children - 1; j++) {
-        node->children[j] = node->children[j + 1];
-      }
-      node->n_children--;
-      node->children = realloc(node->children, node->n_children * sizeof(Node));
-      break;
-    }
+// Adds a reference to a string that is already interned.
+char *retain(char *str) {
+  if (str != NULL) {
+    g_mutex_lock(&intern_lock);
+    interned_entry(str)->refs++;
+    string_refs++;
+    g_mutex_unlock(&intern_lock);
   }
+  return str;
 }
 
-void serialize_node(Node *node, Node *parent, string *s) {
-  if (parent != NULL) {
-    if (s->len + 100 > s->size) {
-      s->size *= 2;
-      s->str = realloc(s->str, s->size);
-    }
-    s->len +=
-        sprintf(s->str + s->len, "edge	%d	%d\n", parent->id, node->id);
-    if (s->len + 100 > s->size) {
-      s->size *= 2;
-      s->str = realloc(s->str, s->size);
-    }
-    s->len +=
-        sprintf(s->str + s->len, "node	%d	%s\n", node->id, node->name);
-    if (node->color != 0) {
-      if (s->len + 100 > s->size) {
-        s->size *= 2;
-        s->str = realloc(s->str, s->size);
-      }
-      s->len += sprintf(s->str + s->len, "color	%d	%d\n", node->id,
-                        node->color);
-    }
-    if (node->filename != NULL) {
-      if (s->len + 100 > s->size) {
-        s->size *= 2;
-        s->str = realloc(s->str, s->size);
-      }
-      s->len += sprintf(s->str + s->len, "filename	%d	%s\n", node->id,
-                        node->filename);
-    }
+void release(char *str) {
+  if (str == NULL) {
+    return;
   }
-  for (int i = 0; i < node->n_children; i++) {
-    serialize_node(node->children[i], node, s);
+
+  Interned *entry = interned_entry(str);
+  g_mutex_lock(&intern_lock);
+  string_refs--;
+  if (--entry->refs == 0) {
+    g_hash_table_remove(interned, str);
+    string_bytes -= sizeof(Interned) + strlen(str) + 1;
+  } else {
+    entry = NULL;
   }
+  g_mutex_unlock(&intern_lock);
+  free(entry);
 }
 
-char *serialize_tree(Node *node) {
-  string s;
-  s.str = malloc(1000);
-  s.size = 1000;
-  s.len = 0;
-
-  serialize_node(node, NULL, &s);
+// Points field at the interned copy of text, releasing what it held before.
+void assign_string(char **field, const char *text) {
+  char *old = *field;
+  *field = text != NULL ? intern(text) : NULL;
+  release(old);
+}
 
-  return s.str;
+// Keeps child_bytes in step with a child array going from old to new size.
+void count_children(int old_size, int new_size) {
+  g_atomic_pointer_add(&child_bytes,
+                       (gssize)(new_size - old_size) * sizeof(Node *));
 }
 
-int hash_string(char *s) {
-  int hash = 0;
-  while (*s) {
-    hash = hash * 31 + *s;
-    s++;
+// Makes a node named name, taking over the reference the caller holds.
+Node *create_node(int id, char *name) {
+  Node *node = malloc(sizeof(Node));
+  if (node == NULL) {
+    printf("Could not allocate memory\n");
+    exit(EXIT_FAILURE);
   }
-  return hash;
+  g_atomic_pointer_add(&live_nodes, 1);
+  node->name = name;
+  node->children = NULL;
+  node->n_children = 0;
+  node->children_size = 0;
+  node->rect = (Rectangle){0, 0, 0, 0};
+  node->selected = false;
+  node->parent = NULL;
+  node->index = 0;
+  node->stale_from = G_MAXINT;
+  node->id = id;
+  node->filename = NULL;
+  node->color = 0;
+  node->mount = NULL;
+  node->mount_loaded = false;
+  node->mount_dirty = false;
+  node->layout = NULL;
+  node->text_width = 0;
+  node->text_font_size = 0;
+  node->subtree_height = 0;
+  node->subtree_rect = (Rectangle){0, 0, 0, 0};
+  node->n_descendents = 0;
+  node->offsets = NULL;
+  node->offsets_size = 0;
+  node->offsets_dirty = true;
+  node->preorder = -1;
+  node->map_slot = -1;
+  node->map_expanded = false;
+  node->size_dirty = true;
+  return node;
 }
 
-Tree *deserialize_tree(char *filename) {
-  FILE *file = fopen(filename, "r");
-  if (file == NULL) {
-    printf("Could not open file %s\n", filename);
-    exit(EXIT_FAILURE);
+bool has_preorder_label(Node *node) {
+  return preorder_version == structure_version && node->preorder >= 0 &&
+         node->preorder < preorder.len &&
+         preorder.nodes[node->preorder] == node;
+}
+
+/*
+ * Uses the preorder labels when they are current, otherwise walks up from
+ * node, so the cost is at worst its depth, never the tree size.
+ */
+bool check_if_descendent(Node *root, Node *node) {
+  if (has_preorder_label(root) && has_preorder_label(node)) {
+    return root->preorder <= node->preorder &&
+           node->preorder <= root->preorder + root->n_descendents;
   }
 
-  Tree *tree = create_tree();
-  tree->root->selected = true;
-
-  // TODO: Fix this
-  char line[100];
-  // TODO: Fix this
-  int line_number = 0;
-  while (fgets(line, 100, file) != NULL) {
-    line_number++;
-    if (strlen(line) == 99) {
-      printf("Line %d is too long\n", line_number);
-      exit(EXIT_FAILURE);
+  for (; node != NULL; node = node->parent) {
+    if (node == root) {
+      return true;
     }
+  }
 
-    char type[100];
-    sscanf(line, "%s", type);
+  return false;
+}
 
-    line[strlen(line) - 1] = '\0';
+void select_node(Node *node) {
+  if (selected_node != NULL) {
+    selected_node->selected = false;
+  }
 
-    if (strcmp(type, "edge") == 0) {
-      int parentID;
-      int childID;
-      sscanf(line, "%s	%d	%d", type, &parentID, &childID);
+  selected_node = node;
+  if (node != NULL) {
+    node->selected = true;
+  }
+}
 
-      Node *parentNode = find_node(tree->root, parentID);
-      Node *childNode = create_node(childID);
+Node *get_selected_node(Node *node) {
+  if (selected_node != NULL && check_if_descendent(node, selected_node)) {
+    return selected_node;
+  }
 
-      add_child(parentNode, childNode);
-    } else if (strcmp(type, "color") == 0) {
-      int nodeID;
-      int color;
-      sscanf(line, "%s\t%d\t%d", type, &nodeID, &color);
+  return NULL;
+}
 
-      Node *node = find_node(tree->root, nodeID);
-      node->color = color;
-    } else if (strcmp(type, "node") == 0) {
-      int nodeID;
-      // TODO: Fix this
-      char name[100];
-      sscanf(line, "%s\t%d\t%s", type, &nodeID, name);
+/*
+ * Besides the selected node, any number of nodes can be marked. The marked
+ * nodes are kept in a set so that bulk edits only visit those nodes and
+ * their parents.
+ */
+bool is_marked(Node *node) {
+  return marked != NULL && g_hash_table_contains(marked, node);
+}
 
-      Node *node = find_node(tree->root, nodeID);
-      node->name = strdup(get_name(line));
-    } else if (strcmp(type, "filename") == 0) {
-      int nodeID;
-      char filename[100];
-      sscanf(line, "%s\t%d\t%s", type, &nodeID, filename);
+int count_marked() { return marked != NULL ? g_hash_table_size(marked) : 0; }
 
-      Node *node = find_node(tree->root, nodeID);
-      node->filename = strdup(filename);
-    } else {
-      printf("Unknown type: %s\n", type);
-    }
+void mark_node(Node *node) {
+  if (marked == NULL) {
+    marked = g_hash_table_new(NULL, NULL);
   }
-
-  fclose(file);
-
-  char *s = serialize_tree(tree->root);
-  current_hash = hash_string(s);
-  free(s);
-
-  return tree;
+  g_hash_table_add(marked, node);
 }
 
-void draw_rect(cairo_t *cr, Rectangle rect) {
-  cairo_set_line_width(cr, 1);
-  double width = rect.x2 - rect.x1;
-  double height = rect.y2 - rect.y1;
-  cairo_rectangle(cr, rect.x1 + x_offset, rect.y1 + y_offset, width, height);
-  cairo_stroke(cr);
+void unmark_node(Node *node) {
+  if (marked != NULL) {
+    g_hash_table_remove(marked, node);
+  }
 }
 
-void fill_rect(cairo_t *cr, Rectangle rect) {
-  double width = rect.x2 - rect.x1;
-  double height = rect.y2 - rect.y1;
-  cairo_rectangle(cr, rect.x1 + x_offset, rect.y1 + y_offset, width, height);
-  cairo_fill(cr);
+void toggle_mark(Node *node) {
+  if (is_marked(node)) {
+    unmark_node(node);
+  } else {
+    mark_node(node);
+  }
 }
 
-void draw_circle(cairo_t *cr, double x, double y, double radius) {
-  cairo_set_line_width(cr, 1);
-  cairo_arc(cr, x + x_offset, y + y_offset, radius, 0, 2 * M_PI);
-  cairo_stroke(cr);
+void clear_marks() {
+  if (marked != NULL) {
+    g_hash_table_remove_all(marked);
+  }
 }
 
-void fill_circle(cairo_t *cr, double x, double y, double radius) {
-  cairo_arc(cr, x + x_offset, y + y_offset, radius, 0, 2 * M_PI);
-  cairo_fill(cr);
+void mark_subtree(Node *node) {
+  mark_node(node);
+  for (int i = 0; i < node->n_children; i++) {
+    mark_subtree(node->children[i]);
+  }
 }
 
-void draw_connector(cairo_t *cr, double x1, double y1, double x2, double y2) {
-  x1 += connector_radius;
-  x2 -= connector_radius;
-  double xm = (x1 + x2) / 2;
+// Lists the marked nodes, or only those that have no marked ancestor.
+NodeList marked_nodes(bool roots_only) {
+  NodeList nodes = {NULL, 0, 0};
+  if (marked == NULL) {
+    return nodes;
+  }
 
-  set_color(cr, COLOR_FOREGROUND, 1.0);
-  cairo_set_line_width(cr, 1);
-  cairo_move_to(cr, x1 + x_offset, y1 + y_offset);
-  cairo_curve_to(cr, xm + x_offset, y1 + y_offset, xm + x_offset, y2 + y_offset,
-                 x2 + x_offset, y2 + y_offset);
-  cairo_stroke(cr);
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init(&iter, marked);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    Node *node = (Node *)key;
+    Node *ancestor = node->parent;
+    while (roots_only && ancestor != NULL && !is_marked(ancestor)) {
+      ancestor = ancestor->parent;
+    }
+    if (!roots_only || ancestor == NULL) {
+      append_node(&nodes, node);
+    }
+  }
+  return nodes;
 }
 
-void draw_text(cairo_t *cr, double x, double y, char *text) {
-  cairo_move_to(cr, x + x_offset, y + y_offset);
-  cairo_show_text(cr, text);
+void label_preorder(Node *node) {
+  node->preorder = preorder.len;
+  append_node(&preorder, node);
+  for (int i = 0; i < node->n_children; i++) {
+    label_preorder(node->children[i]);
+  }
 }
 
-void draw_node(cairo_t *cr, Node *node, double x, double y) {
-  cairo_text_extents_t extents;
-  cairo_text_extents(cr, node->name, &extents);
-  extents.height = font_size;
+/*
+ * Relabels the subtree of node in place, starting from label next, and
+ * returns the label after it. Used after an edit that moves nodes around
+ * inside a subtree without changing its size, so the labels outside it are
+ * still right.
+ */
+int place_preorder(Node *node, int next) {
+  node->preorder = next;
+  preorder.nodes[next++] = node;
+  for (int i = 0; i < node->n_children; i++) {
+    next = place_preorder(node->children[i], next);
+  }
+  return next;
+}
 
-  if (node->filename != NULL) {
-    set_color(cr, COLOR_ACCENT, 1.0);
-    cairo_set_source_rgba(cr, 0.0, 1.0, 0.0, 0.15);
-    fill_circle(cr, x + extents.width + 2 * xpad, y, 5);
-    set_color(cr, COLOR_FOREGROUND, 1.0);
-    draw_circle(cr, x + extents.width + 2 * xpad, y, 5);
+/*
+ * Relabels the tree in document order. Edits only mark the labels stale, so
+ * a burst of edits costs one relabel the next time the order is needed.
+ */
+void ensure_preorder(Tree *tree) {
+  if (preorder_version != structure_version) {
+    preorder.len = 0;
+    label_preorder(tree->root);
+    preorder_version = structure_version;
   }
+}
 
-  if (node->parent != NULL) {
-    double x1 = x;
-    double y1 = (y + y + extents.height + 2 * ypad) / 2;
+Node *find_node(Tree *tree, int id) {
+  return g_hash_table_lookup(tree->nodes, GINT_TO_POINTER(id));
+}
 
-    set_color(cr, COLOR_ACCENT, 1.0);
-    fill_circle(cr, x1, y1, connector_radius);
-    set_color(cr, COLOR_FOREGROUND, 1.0);
-    draw_circle(cr, x1, y1, connector_radius);
+int get_unused_id(Tree *tree) {
+  while (find_node(tree, tree->next_id) != NULL) {
+    tree->next_id++;
   }
+  return tree->next_id;
+}
 
-  if (node->n_children != 0) {
-    double x2 = x + extents.width + 2 * xpad;
-    double y2 = (y + y + extents.height + 2 * ypad) / 2;
-
-    set_color(cr, COLOR_ACCENT, 1.0);
-    fill_circle(cr, x2, y2, connector_radius);
-    set_color(cr, COLOR_FOREGROUND, 1.0);
-    draw_circle(cr, x2, y2, connector_radius);
+void register_node(Tree *tree, Node *node) {
+  if (!g_hash_table_contains(tree->nodes, GINT_TO_POINTER(node->id))) {
+    g_hash_table_insert(tree->nodes, GINT_TO_POINTER(node->id), node);
   }
+}
 
-  if (node->selected) {
-    set_color(cr, COLOR_ACCENT_FAINT, 1.0);
-  } else {
-    set_color(cr, COLOR_BACKGROUND, 1.0);
+Tree *create_tree() {
+  Tree *tree = malloc(sizeof(Tree));
+  tree->root = create_node(0, intern("root"));
+  tree->nodes = g_hash_table_new(g_direct_hash, g_direct_equal);
+  tree->next_id = 0;
+  tree->detached = false;
+  register_node(tree, tree->root);
+  return tree;
+}
+
+// Marks node and its ancestors to have their subtree height redone.
+void invalidate_size(Node *node) {
+  for (; node != NULL && !node->size_dirty; node = node->parent) {
+    node->size_dirty = true;
   }
-  fill_rect(cr, (Rectangle){x, y, x + extents.width + 2 * xpad,
-                            y + extents.height + 2 * ypad});
+}
 
-  if (node->color != 0) {
-    switch (node->color) {
-    case 1:
-      cairo_set_source_rgba(cr, 0.0, 1.0, 0.0, 0.15);
-      break;
-    case 2:
-      cairo_set_source_rgba(cr, 1.0, 0.0, 0.0, 0.15);
-      break;
-    case 3:
-      cairo_set_source_rgba(cr, 0.0, 0.0, 1.0, 0.15);
-      break;
+void append_child(Node *node, Node *child) {
+  if (node->n_children == node->children_size) {
+    int size = node->children_size == 0 ? 4 : node->children_size * 2;
+    count_children(node->children_size, size);
+    node->children_size = size;
+    node->children =
+        realloc(node->children, node->children_size * sizeof(Node *));
+    if (node->children == NULL) {
+      printf("Could not allocate memory\n");
+      exit(EXIT_FAILURE);
     }
-    fill_rect(cr, (Rectangle){x, y, x + extents.width + 2 * xpad,
-                              y + extents.height + 2 * ypad});
   }
 
-  set_color(cr, COLOR_FOREGROUND, 1.0);
-  draw_text(cr, x + xpad, y + ypad + extents.height, node->name);
-
-  set_color(cr, COLOR_FOREGROUND, 1.0);
-  draw_rect(cr, (Rectangle){x, y, x + extents.width + 2 * xpad,
-                            y + extents.height + 2 * ypad});
+  child->index = node->n_children;
+  node->children[node->n_children++] = child;
+  child->parent = node;
+  node->offsets_dirty = true;
+  invalidate_size(node);
+}
 
-  extents.width += 2 * xpad;
-  extents.height += 2 * ypad;
+void adjust_descendents(Node *node, int delta) {
+  for (; node != NULL; node = node->parent) {
+    node->n_descendents += delta;
+    node->offsets_dirty = true;
+  }
+}
 
-  node->rect = (Rectangle){x, y, x + extents.width, y + extents.height};
+void add_child(Node *node, Node *child) {
+  append_child(node, child);
+  adjust_descendents(node, child->n_descendents + 1);
+  structure_version++;
 }
 
-Rectangle draw_nodes(cairo_t *cr, Node *node, double x, double y,
-                     double parent_x, double parent_y) {
-  draw_node(cr, node, x, y);
+/*
+ * Returns the position of node among its siblings. Removing a child shifts
+ * the ones after it forward without renumbering them, which would cost a
+ * cache miss per sibling. The parent keeps the first position whose index
+ * may be too high instead, and the first lookup past it renumbers the rest
+ * once.
+ */
+int child_index(Node *node) {
+  Node *parent = node->parent;
+  if (node->index >= parent->stale_from) {
+    for (int i = parent->stale_from; i < parent->n_children; i++) {
+      parent->children[i]->index = i;
+    }
+    parent->stale_from = G_MAXINT;
+  }
+  return node->index;
+}
 
-  if (parent_x != 0 && parent_y != 0) {
-    draw_connector(cr, parent_x, parent_y, node->rect.x1,
-                   (node->rect.y1 + node->rect.y2) / 2);
+void remove_child(Node *node, Node *child) {
+  if (child->parent != node) {
+    return;
   }
 
-  Rectangle rect = node->rect;
+  // A stale index is too high by at most the removals since the last
+  // renumbering, so walking back keeps a run of removals from renumbering.
+  int i = child->index;
+  if (i >= node->stale_from) {
+    i = MIN(i, node->n_children - 1);
+    while (node->children[i] != child) {
+      i--;
+    }
+  }
+  memmove(&node->children[i], &node->children[i + 1],
+          (node->n_children - i - 1) * sizeof(Node *));
+  node->n_children--;
+  node->stale_from = MIN(node->stale_from, i);
+  adjust_descendents(node, -(child->n_descendents + 1));
+  child->parent = NULL;
+  structure_version++;
+  invalidate_size(node);
+}
 
+int calculate_descendents(Node *node) {
+  node->n_descendents = 0;
+  node->offsets_dirty = true;
   for (int i = 0; i < node->n_children; i++) {
-    Rectangle child_rect =
-        draw_nodes(cr, node->children[i], node->rect.x2 + xmargin, y,
-                   node->rect.x2, (node->rect.y1 + node->rect.y2) / 2);
-    y = child_rect.y2 + ymargin;
+    node->n_descendents += calculate_descendents(node->children[i]) + 1;
+  }
+  return node->n_descendents;
+}
 
-    if (child_rect.y2 > rect.y2) {
-      rect.y2 = child_rect.y2;
+void reserve_string(string *s, int n) {
+  if (s->len + n + 1 > s->size) {
+    while (s->len + n + 1 > s->size) {
+      s->size *= 2;
     }
-
-    if (child_rect.x2 > rect.x2) {
-      rect.x2 = child_rect.x2;
+    s->str = realloc(s->str, s->size);
+    if (s->str == NULL) {
+      printf("Could not allocate memory\n");
+      exit(EXIT_FAILURE);
     }
   }
+}
+
+void serialize_fields(Node *node, int id, string *s) {
+  reserve_string(s, 100 + strlen(node->name));
+  s->len += sprintf(s->str + s->len, "node	%d	%s\n", id, node->name);
+  if (node->color != 0) {
+    reserve_string(s, 100);
+    s->len += sprintf(s->str + s->len, "color	%d	%d\n", id, node->color);
+  }
+  if (node->filename != NULL) {
+    reserve_string(s, 100 + strlen(node->filename));
+    s->len +=
+        sprintf(s->str + s->len, "filename	%d	%s\n", id, node->filename);
+  }
+}
+
+/*
+ * Writes the records of node itself. Returns false for mounts, whose children
+ * are kept in the shard file.
+ */
+bool serialize_entry(Node *node, int parent_id, string *s) {
+  reserve_string(s, 100);
+  s->len += sprintf(s->str + s->len, "edge	%d	%d\n", parent_id, node->id);
+  serialize_fields(node, node->id, s);
+
+  if (node->mount != NULL) {
+    reserve_string(s, 100 + strlen(node->mount));
+    s->len +=
+        sprintf(s->str + s->len, "mount	%d	%s\n", node->id, node->mount);
+    return false;
+  }
 
-  return rect;
+  return true;
 }
 
-Node *get_selected_node(Node *node) {
-  if (node->selected) {
-    return node;
+void serialize_node(Node *node, int parent_id, string *s) {
+  if (!serialize_entry(node, parent_id, s)) {
+    return;
   }
 
   for (int i = 0; i < node->n_children; i++) {
-    Node *selected = get_selected_node(node->children[i]);
-    if (selected != NULL) {
-      return selected;
-    }
+    serialize_node(node->children[i], node->id, s);
   }
-
-  return NULL;
 }
 
-static gboolean handle_return(GtkWidget *widget, GdkEventKey *event,
-                              gpointer data) {
-  (void)widget;
+char *serialize_tree(Node *node) {
+  TRACE_BEGIN(start);
+  string s;
+  s.str = malloc(1000);
+  s.size = 1000;
+  s.len = 0;
+  s.str[0] = '\0';
 
-  if (event->keyval == GDK_KEY_Return) {
-    gtk_dialog_response(GTK_DIALOG(data), 1);
-    return TRUE;
+  for (int i = 0; i < node->n_children; i++) {
+    serialize_node(node->children[i], node->id, &s);
   }
 
-  return FALSE;
+  TRACE_END(start, "serialize_tree", NULL);
+  return s.str;
 }
 
-char *ask_for_name() {
-  GtkWidget *dialog =
-      gtk_dialog_new_with_buttons("Enter name", NULL, 0, "_OK", 1, NULL);
-  GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
-  GtkWidget *entry = gtk_entry_new();
+/*
+ * Serializes node as the root of a standalone tree: it takes id 0 and keeps
+ * its name, color and filename.
+ */
+char *serialize_subtree(Node *node) {
+  string s;
+  s.str = malloc(1000);
+  s.size = 1000;
+  s.len = 0;
+
+  serialize_fields(node, 0, &s);
+  for (int i = 0; i < node->n_children; i++) {
+    serialize_node(node->children[i], 0, &s);
+  }
+
+  return s.str;
+}
+
+int hash_bytes(int hash, char *s, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash = hash * 31 + s[i];
+  }
+  return hash;
+}
+
+int hash_string(char *s) { return hash_bytes(0, s, strlen(s)); }
+
+typedef enum RecordType {
+  RECORD_EDGE,
+  RECORD_NODE,
+  RECORD_COLOR,
+  RECORD_FILENAME,
+  RECORD_MOUNT,
+  RECORD_UNKNOWN,
+} RecordType;
+
+typedef struct Record {
+  RecordType type;
+  int line;
+  int id;
+  int value;
+  char *text;
+} Record;
+
+typedef struct Chunk {
+  char *start;
+  char *end;
+  Record *records;
+  int n_records;
+  int size;
+  int n_lines;
+} Chunk;
+
+void append_record(Chunk *chunk, Record record) {
+  if (chunk->n_records == chunk->size) {
+    chunk->size = chunk->size == 0 ? 256 : chunk->size * 2;
+    chunk->records = realloc(chunk->records, chunk->size * sizeof(Record));
+    if (chunk->records == NULL) {
+      printf("Could not allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  chunk->records[chunk->n_records++] = record;
+}
+
+char *skip_field(char *s) {
+  while (*s != '\0' && !isspace((unsigned char)*s)) {
+    s++;
+  }
+  return s;
+}
+
+char *skip_space(char *s) {
+  while (*s != '\0' && isspace((unsigned char)*s)) {
+    s++;
+  }
+  return s;
+}
+
+/*
+ * Finds the text of a node, filename or mount record. It runs from the tab
+ * after the id to the end of the line, so names and paths may hold spaces.
+ */
+char *record_text(char *line, char *rest) {
+  char *text = strchr(line, '\t');
+  if (text != NULL) {
+    text = strchr(text + 1, '\t');
+  }
+  return text != NULL ? text + 1 : skip_space(rest);
+}
+
+void parse_line(Chunk *chunk, char *line) {
+  Record record = {RECORD_UNKNOWN, chunk->n_lines, 0, 0, NULL};
+
+  char *type = skip_space(line);
+  char *rest = skip_field(type);
+  if (rest == type) {
+    return;
+  }
+
+  size_t type_len = rest - type;
+  if (type_len == 4 && strncmp(type, "edge", 4) == 0) {
+    record.type = RECORD_EDGE;
+    record.id = strtol(rest, &rest, 10);
+    record.value = strtol(rest, &rest, 10);
+  } else if (type_len == 5 && strncmp(type, "color", 5) == 0) {
+    record.type = RECORD_COLOR;
+    record.id = strtol(rest, &rest, 10);
+    record.value = strtol(rest, &rest, 10);
+  } else if (type_len == 4 && strncmp(type, "node", 4) == 0) {
+    record.type = RECORD_NODE;
+    record.id = strtol(rest, &rest, 10);
+    record.text = record_text(line, rest);
+  } else if (type_len == 8 && strncmp(type, "filename", 8) == 0) {
+    record.type = RECORD_FILENAME;
+    record.id = strtol(rest, &rest, 10);
+    record.text = record_text(line, rest);
+  } else if (type_len == 5 && strncmp(type, "mount", 5) == 0) {
+    record.type = RECORD_MOUNT;
+    record.id = strtol(rest, &rest, 10);
+    record.text = record_text(line, rest);
+  } else {
+    *rest = '\0';
+    record.text = type;
+  }
+
+  append_record(chunk, record);
+}
+
+void parse_chunk(void *item, void *data) {
+  (void)data;
+
+  Chunk *chunk = (Chunk *)item;
+  char *line = chunk->start;
+  while (line < chunk->end) {
+    char *newline = memchr(line, '\n', chunk->end - line);
+    if (newline == NULL) {
+      newline = chunk->end;
+    }
+    *newline = '\0';
+
+    chunk->n_lines++;
+    parse_line(chunk, line);
+
+    line = newline + 1;
+  }
+}
+
+Node *find_record_node(Tree *tree, int id, int line) {
+  Node *node = find_node(tree, id);
+  if (node == NULL) {
+    printf("Unknown node %d on line %d\n", id, line);
+  }
+  return node;
+}
+
+int remap_id(GHashTable *remap, int id) {
+  gpointer value;
+  if (remap != NULL && g_hash_table_lookup_extended(
+                           remap, GINT_TO_POINTER(id), NULL, &value)) {
+    return GPOINTER_TO_INT(value);
+  }
+  return id;
+}
+
+/*
+ * Applies one record. When remap is given, ids that are already taken get a
+ * fresh id and the mapping is kept for the records that follow. Returns false
+ * if the record refers to a node that does not exist.
+ */
+bool apply_record(Tree *tree, Record *record, int line, GHashTable *remap) {
+  Node *node = NULL;
+  if (record->type != RECORD_UNKNOWN) {
+    node = find_record_node(tree, remap_id(remap, record->id), line);
+    if (node == NULL) {
+      return false;
+    }
+  }
+
+  switch (record->type) {
+  case RECORD_EDGE: {
+    int id = record->value;
+    if (remap != NULL && find_node(tree, id) != NULL) {
+      int fresh = get_unused_id(tree);
+      g_hash_table_insert(remap, GINT_TO_POINTER(id), GINT_TO_POINTER(fresh));
+      id = fresh;
+    }
+    // A node record usually follows and names it.
+    Node *child = create_node(id, intern("New Node"));
+    append_child(node, child);
+    register_node(tree, child);
+    // A detached tree is built off the main thread and has no labels to stale.
+    if (!tree->detached) {
+      structure_version++;
+    }
+    break;
+  }
+  case RECORD_COLOR:
+    node->color = record->value;
+    break;
+  case RECORD_NODE:
+    assign_string(&node->name, record->text);
+    invalidate_size(node);
+    break;
+  case RECORD_FILENAME:
+    assign_string(&node->filename, record->text);
+    break;
+  case RECORD_MOUNT:
+    node->mount = strdup(record->text);
+    break;
+  case RECORD_UNKNOWN:
+    printf("Unknown type: %s\n", record->text);
+    break;
+  }
+  return true;
+}
+
+/*
+ * Splits data, which must have room for a terminating NUL at data[size], into
+ * line-aligned chunks and parses them into records in parallel.
+ */
+Chunk *parse_chunks(char *data, size_t size, int *n_chunks) {
+  data[size] = '\0';
+
+  size_t min_chunk = 1 << 20;
+  *n_chunks = g_get_num_processors() * 4;
+  if (size / min_chunk + 1 < (size_t)*n_chunks) {
+    *n_chunks = size / min_chunk + 1;
+  }
+
+  Chunk *chunks = calloc(*n_chunks, sizeof(Chunk));
+  Chunk **items = malloc(*n_chunks * sizeof(Chunk *));
+  char *start = data;
+  for (int i = 0; i < *n_chunks; i++) {
+    char *end = data + size * (i + 1) / *n_chunks;
+    if (end < start) {
+      end = start;
+    }
+    if (i < *n_chunks - 1 && end < data + size) {
+      char *newline = memchr(end, '\n', data + size - end);
+      end = newline != NULL ? newline + 1 : data + size;
+    }
+    chunks[i].start = start;
+    chunks[i].end = end;
+    items[i] = &chunks[i];
+    start = end;
+  }
+
+  run_parallel(parse_chunk, (void **)items, *n_chunks, NULL);
+  free(items);
+
+  return chunks;
+}
+
+void request_redraw();
+
+/*
+ * Applies the records in file order and frees the chunks. In the background
+ * the tree lock is released between batches so the window can draw the part
+ * of the tree linked so far. Advances line past the lines consumed, so line
+ * numbers in errors keep counting across calls. Stops at the first bad
+ * record and returns false, leaving the records before it applied.
+ */
+bool apply_chunks(Tree *tree, Chunk *chunks, int n_chunks, bool background,
+                  GHashTable *remap, int *line) {
+  if (background) {
+    g_rec_mutex_lock(&tree_lock);
+  }
+
+  bool ok = true;
+  int applied = 0;
+  for (int i = 0; i < n_chunks; i++) {
+    for (int j = 0; ok && j < chunks[i].n_records; j++) {
+      Record *record = &chunks[i].records[j];
+      ok = apply_record(tree, record, *line + record->line, remap);
+
+      applied++;
+      if (background && applied % LOAD_BATCH == 0) {
+        g_rec_mutex_unlock(&tree_lock);
+        request_redraw();
+        g_rec_mutex_lock(&tree_lock);
+      }
+    }
+    *line += chunks[i].n_lines;
+    free(chunks[i].records);
+  }
+
+  if (background) {
+    g_rec_mutex_unlock(&tree_lock);
+  }
+
+  free(chunks);
+  return ok;
+}
+
+Tree *parse_tree(char *data, size_t size) {
+  int n_chunks;
+  Chunk *chunks = parse_chunks(data, size, &n_chunks);
+
+  Tree *tree = create_tree();
+  int line = 0;
+  if (!apply_chunks(tree, chunks, n_chunks, false, NULL, &line)) {
+    exit(EXIT_FAILURE);
+  }
+  calculate_descendents(tree->root);
+
+  return tree;
+}
+
+typedef enum Compression {
+  COMPRESSION_NONE,
+  COMPRESSION_GZIP,
+  COMPRESSION_ZSTD,
+} Compression;
+
+Compression detect_compression(unsigned char *data, size_t len) {
+  if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+    return COMPRESSION_GZIP;
+  }
+  if (len >= 4 && data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f &&
+      data[3] == 0xfd) {
+    return COMPRESSION_ZSTD;
+  }
+  return COMPRESSION_NONE;
+}
+
+typedef struct Reader {
+  FILE *file;
+  char *path;
+  Compression compression;
+  unsigned char *in;
+  size_t in_len;
+  size_t in_pos;
+  bool eof;
+  long total;
+  long consumed;
+  bool mid_stream;
+  bool failed;
+  z_stream gzip;
+  ZSTD_DCtx *zstd;
+} Reader;
+
+/*
+ * Opens a plain, gzip or zstd file, telling them apart by magic bytes.
+ * Returns NULL if the file cannot be read.
+ */
+Reader *open_reader(char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    printf("Could not open file %s\n", path);
+    return NULL;
+  }
+
+  Reader *reader = calloc(1, sizeof(Reader));
+  reader->file = file;
+  reader->path = path;
+  reader->in = malloc(READ_SIZE);
+
+  fseek(file, 0, SEEK_END);
+  reader->total = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  reader->in_len = fread(reader->in, 1, READ_SIZE, file);
+  reader->consumed = reader->in_len;
+  reader->eof = reader->in_len == 0;
+  reader->compression = detect_compression(reader->in, reader->in_len);
+
+  if (reader->compression == COMPRESSION_GZIP &&
+      inflateInit2(&reader->gzip, 15 + 16) != Z_OK) {
+    printf("Could not decompress file %s\n", path);
+    fclose(file);
+    free(reader->in);
+    free(reader);
+    return NULL;
+  }
+  if (reader->compression == COMPRESSION_ZSTD) {
+    reader->zstd = ZSTD_createDCtx();
+  }
+
+  return reader;
+}
+
+// Ends the input after a decompression error; the caller checks failed.
+void fail_reader(Reader *reader, char *problem) {
+  printf("%s %s\n", problem, reader->path);
+  reader->failed = true;
+  reader->mid_stream = false;
+  reader->eof = true;
+  reader->in_pos = reader->in_len;
+}
+
+void fill_input(Reader *reader) {
+  if (reader->in_pos < reader->in_len || reader->eof) {
+    return;
+  }
+
+  reader->in_len = fread(reader->in, 1, READ_SIZE, reader->file);
+  reader->in_pos = 0;
+  reader->consumed += reader->in_len;
+  reader->eof = reader->in_len == 0;
+}
+
+/*
+ * Reads up to size decompressed bytes into out. Returns 0 at the end of the
+ * file, or after an error, which sets failed. Concatenated gzip members are
+ * read as one stream. A file that ends inside a gzip member or zstd frame is
+ * an error; the decompressor is first given the chance to flush what it
+ * still holds.
+ */
+size_t read_input(Reader *reader, char *out, size_t size) {
+  size_t produced = 0;
+  while (produced < size) {
+    fill_input(reader);
+    if (reader->in_pos == reader->in_len && !reader->mid_stream) {
+      break;
+    }
+
+    unsigned char *in = reader->in + reader->in_pos;
+    size_t available = reader->in_len - reader->in_pos;
+    size_t before = produced;
+    switch (reader->compression) {
+    case COMPRESSION_NONE: {
+      size_t n = available < size - produced ? available : size - produced;
+      memcpy(out + produced, in, n);
+      reader->in_pos += n;
+      produced += n;
+      break;
+    }
+    case COMPRESSION_GZIP: {
+      z_stream *z = &reader->gzip;
+      z->next_in = in;
+      z->avail_in = available;
+      z->next_out = (unsigned char *)out + produced;
+      z->avail_out = size - produced;
+      int status = inflate(z, Z_NO_FLUSH);
+      reader->in_pos += available - z->avail_in;
+      produced = size - z->avail_out;
+      reader->mid_stream = status == Z_OK;
+      if (status == Z_STREAM_END) {
+        inflateReset(z);
+      } else if (status != Z_OK && available == 0) {
+        fail_reader(reader, "Unexpected end of file");
+      } else if (status != Z_OK) {
+        fail_reader(reader, "Could not decompress file");
+      }
+      break;
+    }
+    case COMPRESSION_ZSTD: {
+      ZSTD_inBuffer input = {in, available, 0};
+      ZSTD_outBuffer output = {out, size, produced};
+      size_t status = ZSTD_decompressStream(reader->zstd, &output, &input);
+      if (ZSTD_isError(status)) {
+        fail_reader(reader, "Could not decompress file");
+        break;
+      }
+      reader->in_pos += input.pos;
+      produced = output.pos;
+      reader->mid_stream = status != 0;
+      break;
+    }
+    }
+
+    if (available == 0 && produced == before && reader->mid_stream) {
+      fail_reader(reader, "Unexpected end of file");
+    }
+  }
+
+  return produced;
+}
+
+void close_reader(Reader *reader) {
+  if (reader->compression == COMPRESSION_GZIP) {
+    inflateEnd(&reader->gzip);
+  }
+  ZSTD_freeDCtx(reader->zstd);
+  fclose(reader->file);
+  free(reader->in);
+  free(reader);
+}
+
+typedef struct Block {
+  char *data;
+  size_t len;
+  size_t size;
+  int permille;
+  bool last;
+} Block;
+
+typedef struct BlockReader {
+  Reader *reader;
+  GAsyncQueue *full;
+  GAsyncQueue *empty;
+} BlockReader;
+
+/*
+ * Fills empty blocks with whole lines of decompressed text and hands them to
+ * the parser. Only N_BLOCKS are in flight, so reading stays ahead of parsing
+ * without buffering the whole file.
+ */
+gpointer read_blocks(gpointer data) {
+  BlockReader *blocks = (BlockReader *)data;
+  Reader *reader = blocks->reader;
+  string carry = {malloc(1000), 0, 1000};
+
+  bool last = false;
+  while (!last) {
+    Block *block = g_async_queue_pop(blocks->empty);
+    while (block->size <= (size_t)carry.len) {
+      block->size *= 2;
+      block->data = realloc(block->data, block->size);
+    }
+    memcpy(block->data, carry.str, carry.len);
+    block->len = carry.len;
+
+    size_t end = 0;
+    for (size_t i = block->len; i > 0; i--) {
+      if (block->data[i - 1] == '\n') {
+        end = i;
+        break;
+      }
+    }
+
+    while (true) {
+      if (block->len == block->size - 1) {
+        if (end > 0) {
+          break;
+        }
+        block->size *= 2;
+        block->data = realloc(block->data, block->size);
+      }
+
+      char *start = block->data + block->len;
+      size_t n = read_input(reader, start, block->size - 1 - block->len);
+      block->len += n;
+      if (n == 0) {
+        last = true;
+        end = block->len;
+        break;
+      }
+      for (size_t i = n; i > 0; i--) {
+        if (start[i - 1] == '\n') {
+          end = start + i - block->data;
+          break;
+        }
+      }
+    }
+
+    carry.len = 0;
+    reserve_string(&carry, block->len - end + 1);
+    memcpy(carry.str, block->data + end, block->len - end);
+    carry.len = block->len - end;
+
+    block->len = end;
+    block->last = last;
+    block->permille =
+        reader->total > 0 ? (long)reader->consumed * 1000 / reader->total : 0;
+    g_async_queue_push(blocks->full, block);
+  }
+
+  free(carry.str);
+  return NULL;
+}
+
+/*
+ * Loads the file at path into tree block by block. A reader thread does the
+ * I/O and decompression while each block is parsed in parallel and linked.
+ * Returns false if the file could not be read or parsed to the end, in which
+ * case tree holds what was linked before the error. Errors are printed, never
+ * fatal, as this runs on worker threads.
+ */
+bool load_stream(Tree *tree, char *path, bool background, GHashTable *remap) {
+  TRACE_BEGIN(start);
+  Reader *reader = open_reader(path);
+  if (reader == NULL) {
+    return false;
+  }
+  BlockReader blocks = {reader, g_async_queue_new(), g_async_queue_new()};
+
+  Block *buffers = calloc(N_BLOCKS, sizeof(Block));
+  for (int i = 0; i < N_BLOCKS; i++) {
+    buffers[i].size = BLOCK_SIZE + 1;
+    buffers[i].data = malloc(buffers[i].size);
+    g_async_queue_push(blocks.empty, &buffers[i]);
+  }
+
+  GThread *thread = g_thread_new("read", read_blocks, &blocks);
+
+  int line = 0;
+  bool ok = true;
+  bool last = false;
+  while (!last) {
+    Block *block = g_async_queue_pop(blocks.full);
+    if (ok) {
+      int n_chunks;
+      Chunk *chunks = parse_chunks(block->data, block->len, &n_chunks);
+      ok = apply_chunks(tree, chunks, n_chunks, background, remap, &line);
+    }
+    last = block->last;
+
+    if (background) {
+      g_atomic_int_set(&load_permille, block->permille);
+      request_redraw();
+    }
+    g_async_queue_push(blocks.empty, block);
+  }
+
+  g_thread_join(thread);
+  for (int i = 0; i < N_BLOCKS; i++) {
+    free(buffers[i].data);
+  }
+  free(buffers);
+  g_async_queue_unref(blocks.full);
+  g_async_queue_unref(blocks.empty);
+  ok = ok && !reader->failed;
+  close_reader(reader);
+  TRACE_END(start, "load_stream", NULL);
+  return ok;
+}
+
+Tree *deserialize_tree(char *filename) {
+  TRACE_BEGIN(start);
+  Tree *tree = create_tree();
+  if (!load_stream(tree, filename, false, NULL)) {
+    exit(EXIT_FAILURE);
+  }
+  calculate_descendents(tree->root);
+
+  char *s = serialize_tree(tree->root);
+  current_hash = hash_string(s);
+  free(s);
+
+  TRACE_END(start, "deserialize_tree", NULL);
+  return tree;
+}
+
+typedef struct ImportDir {
+  Node *node;
+  char *path;
+  NodeList children;
+  struct ImportDir **subdirs;
+  int n_subdirs;
+} ImportDir;
+
+typedef struct DirEntry {
+  char *name;
+  bool is_dir;
+  bool is_file;
+} DirEntry;
+
+int compare_entries(const void *a, const void *b) {
+  return strcmp(((const DirEntry *)a)->name, ((const DirEntry *)b)->name);
+}
+
+/*
+ * Reads one directory into detached nodes, sorted by name, on a worker. Ids
+ * are reserved for the whole directory at once. Symbolic links are not
+ * followed.
+ */
+void read_directory(void *item, void *data) {
+  ImportDir *dir = (ImportDir *)item;
+  Tree *tree = (Tree *)data;
+
+  DIR *d = opendir(dir->path);
+  if (d == NULL) {
+    return;
+  }
+
+  DirEntry *entries = NULL;
+  int n_entries = 0;
+  int size = 0;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (n_entries == size) {
+      size = size == 0 ? 16 : size * 2;
+      entries = realloc(entries, size * sizeof(DirEntry));
+    }
+
+    DirEntry *e = &entries[n_entries++];
+    e->name = intern(entry->d_name);
+    e->is_dir = entry->d_type == DT_DIR;
+    e->is_file = entry->d_type == DT_REG;
+    if (entry->d_type == DT_UNKNOWN) {
+      char *path = g_build_filename(dir->path, e->name, NULL);
+      struct stat st;
+      if (lstat(path, &st) == 0) {
+        e->is_dir = S_ISDIR(st.st_mode);
+        e->is_file = S_ISREG(st.st_mode);
+      }
+      g_free(path);
+    }
+  }
+  closedir(d);
+
+  qsort(entries, n_entries, sizeof(DirEntry), compare_entries);
+
+  int first_id = g_atomic_int_add(&tree->next_id, n_entries);
+  dir->subdirs = malloc(n_entries * sizeof(ImportDir *));
+  for (int i = 0; i < n_entries; i++) {
+    Node *child = create_node(first_id + i, entries[i].name);
+    child->parent = dir->node;
+    child->index = dir->children.len;
+    append_node(&dir->children, child);
+
+    char *path = g_build_filename(dir->path, entries[i].name, NULL);
+    if (entries[i].is_dir) {
+      ImportDir *subdir = calloc(1, sizeof(ImportDir));
+      subdir->node = child;
+      subdir->path = strdup(path);
+      dir->subdirs[dir->n_subdirs++] = subdir;
+    } else if (entries[i].is_file) {
+      child->filename = intern(path);
+    }
+    g_free(path);
+  }
+  free(entries);
+}
+
+/*
+ * Builds the tree from a directory hierarchy one level at a time. The
+ * directories of a level are read in parallel and then linked in together.
+ */
+void import_directory(Tree *tree, char *path, bool background) {
+  ImportDir *top = calloc(1, sizeof(ImportDir));
+  top->node = tree->root;
+  top->path = strdup(path);
+  char *name = g_path_get_basename(path);
+  assign_string(&tree->root->name, name);
+  g_free(name);
+
+  ImportDir **level = malloc(sizeof(ImportDir *));
+  level[0] = top;
+  int n_level = 1;
+  while (n_level > 0) {
+    run_parallel(read_directory, (void **)level, n_level, tree);
+
+    int n_next = 0;
+    for (int i = 0; i < n_level; i++) {
+      n_next += level[i]->n_subdirs;
+    }
+    ImportDir **next = malloc((n_next + 1) * sizeof(ImportDir *));
+    n_next = 0;
+
+    if (background) {
+      g_rec_mutex_lock(&tree_lock);
+    }
+    for (int i = 0; i < n_level; i++) {
+      ImportDir *dir = level[i];
+      count_children(dir->node->children_size, dir->children.size);
+      dir->node->children = dir->children.nodes;
+      dir->node->n_children = dir->children.len;
+      dir->node->children_size = dir->children.size;
+      dir->node->offsets_dirty = true;
+      for (int j = 0; j < dir->children.len; j++) {
+        register_node(tree, dir->children.nodes[j]);
+      }
+      invalidate_size(dir->node);
+      for (int j = 0; j < dir->n_subdirs; j++) {
+        next[n_next++] = dir->subdirs[j];
+      }
+      free(dir->subdirs);
+      free(dir->path);
+      free(dir);
+    }
+    structure_version++;
+    if (background) {
+      g_rec_mutex_unlock(&tree_lock);
+      request_redraw();
+    }
+
+    free(level);
+    level = next;
+    n_level = n_next;
+  }
+  free(level);
+}
+
+/*
+ * Builds the tree from an outline with one node per line, nested by leading
+ * tabs or spaces. The file is read as a stream and may be compressed.
+ */
+bool import_outline(Tree *tree, char *path, bool background) {
+  Reader *reader = open_reader(path);
+  if (reader == NULL) {
+    return false;
+  }
+  string buffer = {malloc(READ_SIZE + 1), 0, READ_SIZE + 1};
+
+  NodeList stack = {NULL, 0, 0};
+  int *indents = NULL;
+  int first_id = 0;
+  int ids_left = 0;
+  int lines = 0;
+
+  if (background) {
+    g_rec_mutex_lock(&tree_lock);
+  }
+
+  bool done = false;
+  while (!done) {
+    reserve_string(&buffer, READ_SIZE);
+    size_t n = read_input(reader, buffer.str + buffer.len, READ_SIZE);
+    buffer.len += n;
+    if (n == 0) {
+      done = true;
+      buffer.str[buffer.len++] = '\n';
+    }
+
+    char *end = buffer.str + buffer.len;
+    char *line = buffer.str;
+    char *newline;
+    while ((newline = memchr(line, '\n', end - line)) != NULL) {
+      char *text = line;
+      while (text < newline && (*text == ' ' || *text == '\t')) {
+        text++;
+      }
+      int indent = text - line;
+      int len = newline - text;
+      if (len > 0 && text[len - 1] == '\r') {
+        len--;
+      }
+      line = newline + 1;
+      if (len == 0) {
+        continue;
+      }
+
+      while (stack.len > 0 && indents[stack.len - 1] >= indent) {
+        stack.len--;
+      }
+      Node *parent = stack.len > 0 ? stack.nodes[stack.len - 1] : tree->root;
+
+      if (ids_left == 0) {
+        ids_left = LOAD_BATCH;
+        first_id = g_atomic_int_add(&tree->next_id, ids_left);
+      }
+      Node *node = create_node(first_id++, intern_len(text, len));
+      ids_left--;
+      append_child(parent, node);
+      register_node(tree, node);
+      structure_version++;
+
+      append_node(&stack, node);
+      indents = realloc(indents, stack.size * sizeof(int));
+      indents[stack.len - 1] = indent;
+
+      if (background && ++lines % LOAD_BATCH == 0) {
+        g_rec_mutex_unlock(&tree_lock);
+        request_redraw();
+        g_rec_mutex_lock(&tree_lock);
+      }
+    }
+
+    buffer.len = end - line;
+    memmove(buffer.str, line, buffer.len);
+  }
+
+  if (background) {
+    g_rec_mutex_unlock(&tree_lock);
+  }
+
+  free(stack.nodes);
+  free(indents);
+  free(buffer.str);
+  bool ok = !reader->failed;
+  close_reader(reader);
+  return ok;
+}
+
+/*
+ * Imports a directory or an outline file into a tree that only has its root.
+ * Returns false if an outline could not be read to the end.
+ */
+bool import_path(Tree *tree, char *path, bool background) {
+  tree->next_id = get_unused_id(tree);
+
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    import_directory(tree, path, background);
+    return true;
+  }
+  return import_outline(tree, path, background);
+}
+
+typedef struct Loaded {
+  int hash;
+  bool complete;
+} Loaded;
+
+void schedule_frame();
+
+/*
+ * Runs on the main loop once the load thread is done. A tree that failed to
+ * load part way is kept, but read only, so it cannot be saved over the file.
+ */
+gboolean finish_loading(gpointer data) {
+  Loaded *loaded = (Loaded *)data;
+
+  current_hash = loaded->hash;
+  // An import has not been written to filename yet.
+  saved_version = import_source != NULL ? edit_version - 1 : edit_version;
+  if (!loaded->complete) {
+    printf("Could not load all of %s, showing the part read so far\n",
+           import_source != NULL ? import_source : filename);
+    read_only = true;
+  }
+  free(loaded);
+
+  loading = false;
+  layout_dirty = true;
+  schedule_frame();
+  return FALSE;
+}
+
+/*
+ * Loads filename, or imports import_source, into the empty tree passed as
+ * data while the window is already up. Top levels are linked first.
+ */
+gpointer load_tree_thread(gpointer data) {
+  Tree *tree = (Tree *)data;
+
+  Loaded *loaded = malloc(sizeof(Loaded));
+  if (import_source != NULL) {
+    loaded->complete = import_path(tree, import_source, true);
+  } else {
+    loaded->complete = load_stream(tree, filename, true, NULL);
+  }
+
+  g_rec_mutex_lock(&tree_lock);
+  calculate_descendents(tree->root);
+  char *s = serialize_tree(tree->root);
+  g_rec_mutex_unlock(&tree_lock);
+  loaded->hash = hash_string(s);
+  free(s);
+
+  // An import has not been written to filename yet.
+  if (import_source != NULL) {
+    loaded->hash = hash_string("");
+  }
+
+  g_idle_add(finish_loading, loaded);
+  return NULL;
+}
+
+void free_subtree(Tree *tree, Node *node) {
+  for (int i = 0; i < node->n_children; i++) {
+    free_subtree(tree, node->children[i]);
+  }
+
+  if (find_node(tree, node->id) == node) {
+    g_hash_table_remove(tree->nodes, GINT_TO_POINTER(node->id));
+  }
+  for (int i = 0; node->mount_loaded && i < loaded_mounts.len; i++) {
+    if (loaded_mounts.nodes[i] == node) {
+      loaded_mounts.nodes[i] = loaded_mounts.nodes[--loaded_mounts.len];
+      break;
+    }
+  }
+  if (node->layout != NULL) {
+    g_object_unref(node->layout);
+    g_atomic_pointer_add(&live_layouts, -1);
+  }
+  if (!tree->detached) {
+    unmark_node(node);
+  }
+  release(node->name);
+  release(node->filename);
+  free(node->mount);
+  count_children(node->children_size, 0);
+  free(node->children);
+  g_atomic_pointer_add(&offset_bytes,
+                       -(gssize)(node->offsets_size * sizeof(int)));
+  free(node->offsets);
+  free(node);
+  g_atomic_pointer_add(&live_nodes, -1);
+}
+
+// Frees a subtree that was cut out of the tree, moving the view off it.
+void discard_subtree(Tree *tree, Node *node) {
+  if (selected_node != NULL && check_if_descendent(node, selected_node)) {
+    selected_node = NULL;
+  }
+  for (guint i = 0; views != NULL && i < views->len; i++) {
+    View *v = g_ptr_array_index(views, i);
+    if (check_if_descendent(node, v->draw_root)) {
+      v->draw_root = tree->root;
+    }
+  }
+  free_subtree(tree, node);
+}
+
+/*
+ * Marks the shard holding the records of node as modified, or counts an edit
+ * to the main file if no shard holds them. Pass the node whose own fields
+ * changed, or the parent whose children changed.
+ */
+void touch_shard(Node *node) {
+  for (; node != NULL; node = node->parent) {
+    if (node->mount != NULL) {
+      node->mount_dirty = true;
+      return;
+    }
+  }
+  edit_version++;
+}
+
+void unload_mount(Tree *tree, Node *node);
+
+/*
+ * Reads the shard file of a mount node and links its records below it. Ids
+ * that clash with nodes already in memory are renumbered, which leaves the
+ * shard modified so the new ids get written back. A shard that does not
+ * parse is dropped again, leaving the mount unloaded.
+ */
+void load_mount(Tree *tree, Node *node) {
+  if (node->mount == NULL || node->mount_loaded) {
+    return;
+  }
+
+  FILE *file = fopen(node->mount, "r");
+  if (file == NULL) {
+    printf("Could not open file %s\n", node->mount);
+    return;
+  }
+  fclose(file);
+
+  GHashTable *remap = g_hash_table_new(g_direct_hash, g_direct_equal);
+  bool ok = load_stream(tree, node->mount, false, remap);
+
+  adjust_descendents(node->parent, calculate_descendents(node));
+  node->mount_loaded = true;
+  node->mount_dirty = g_hash_table_size(remap) > 0;
+  g_hash_table_destroy(remap);
+
+  append_node(&loaded_mounts, node);
+  if (!ok) {
+    unload_mount(tree, node);
+  }
+}
+
+void unload_mount(Tree *tree, Node *node) {
+  for (int i = 0; i < node->n_children; i++) {
+    free_subtree(tree, node->children[i]);
+  }
+  count_children(node->children_size, 0);
+  free(node->children);
+  node->children = NULL;
+  node->n_children = 0;
+  node->children_size = 0;
+  adjust_descendents(node->parent, -node->n_descendents);
+  node->n_descendents = 0;
+  node->offsets_dirty = true;
+  node->mount_loaded = false;
+  node->mount_dirty = false;
+  structure_version++;
+  invalidate_size(node);
+  layout_dirty = true;
+
+  for (int i = 0; i < loaded_mounts.len; i++) {
+    if (loaded_mounts.nodes[i] == node) {
+      loaded_mounts.nodes[i] = loaded_mounts.nodes[--loaded_mounts.len];
+      break;
+    }
+  }
+}
+
+bool has_dirty_shard(Node *node) {
+  for (int i = 0; i < loaded_mounts.len; i++) {
+    Node *mount = loaded_mounts.nodes[i];
+    if (mount->mount_dirty && check_if_descendent(node, mount)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Unloads shards that are neither drawn, modified nor hold the selection.
+ * Shards that were cut out of the tree are forgotten.
+ */
+void unload_hidden_mounts(Tree *tree) {
+  int i = 0;
+  while (i < loaded_mounts.len) {
+    Node *node = loaded_mounts.nodes[i];
+    if (!check_if_descendent(tree->root, node)) {
+      loaded_mounts.nodes[i] = loaded_mounts.nodes[--loaded_mounts.len];
+      continue;
+    }
+
+    bool drawn = false;
+    for (guint j = 0; views != NULL && j < views->len; j++) {
+      View *v = g_ptr_array_index(views, j);
+      drawn = drawn || check_if_descendent(v->draw_root, node) ||
+              check_if_descendent(node, v->draw_root);
+    }
+    if (!drawn && !has_dirty_shard(node) &&
+        !check_if_descendent(node, selected_node)) {
+      unload_mount(tree, node);
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+}
+
+bool shards_modified(Tree *tree) {
+  for (int i = 0; i < loaded_mounts.len; i++) {
+    Node *node = loaded_mounts.nodes[i];
+    if (node->mount_dirty && check_if_descendent(tree->root, node)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether there are edits that have not been saved, without serializing.
+bool tree_modified(Tree *tree) {
+  return edit_version != saved_version || shards_modified(tree);
+}
+
+/*
+ * Picks the compression for a file about to be written: the extension wins,
+ * otherwise the file keeps the format it already has on disk.
+ */
+Compression output_compression(char *path) {
+  size_t len = strlen(path);
+  if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
+    return COMPRESSION_GZIP;
+  }
+  if (len > 4 && strcmp(path + len - 4, ".zst") == 0) {
+    return COMPRESSION_ZSTD;
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return COMPRESSION_NONE;
+  }
+  unsigned char magic[4];
+  size_t n = fread(magic, 1, sizeof(magic), file);
+  fclose(file);
+  return detect_compression(magic, n);
+}
+
+typedef struct Writer {
+  FILE *file;
+  char *path;
+  char *temp; // Written first and renamed over path once complete.
+  bool failed;
+  Compression compression;
+  unsigned char *out;
+  z_stream gzip;
+  ZSTD_CCtx *zstd;
+  int hash;
+} Writer;
+
+void fail_writer(Writer *writer, char *problem) {
+  if (!writer->failed) {
+    printf("%s %s\n", problem, writer->path);
+  }
+  writer->failed = true;
+}
+
+/*
+ * Opens a temporary file next to path, so that a failed write never leaves
+ * path truncated and a reload never sees a half written file.
+ */
+Writer *open_writer(char *path, Compression compression) {
+  Writer *writer = calloc(1, sizeof(Writer));
+  writer->path = path;
+  writer->temp = malloc(strlen(path) + 8);
+  writer->out = malloc(WRITE_BATCH);
+  if (writer->temp == NULL || writer->out == NULL) {
+    printf("Could not allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+  sprintf(writer->temp, "%s.XXXXXX", path);
+  writer->compression = compression;
+
+  int fd = mkstemp(writer->temp);
+  if (fd < 0) {
+    printf("Could not open file %s\n", path);
+    free(writer->temp);
+    free(writer->out);
+    free(writer);
+    return NULL;
+  }
+  // mkstemp makes the file private, so keep the mode the old file had.
+  struct stat st;
+  fchmod(fd, stat(path, &st) == 0 ? st.st_mode & 07777 : 0644);
+  writer->file = fdopen(fd, "wb");
+  if (writer->file == NULL) {
+    close(fd);
+    fail_writer(writer, "Could not open file");
+  }
+
+  if (compression == COMPRESSION_GZIP &&
+      deflateInit2(&writer->gzip, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                   8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    writer->compression = COMPRESSION_NONE;
+    fail_writer(writer, "Could not start compressing");
+  } else if (compression == COMPRESSION_ZSTD) {
+    writer->zstd = ZSTD_createCCtx();
+    if (writer->zstd == NULL) {
+      fail_writer(writer, "Could not start compressing");
+    }
+  }
+
+  return writer;
+}
+
+void write_bytes(Writer *writer, void *data, size_t len) {
+  if (fwrite(data, 1, len, writer->file) != len) {
+    fail_writer(writer, "Could not write file");
+  }
+}
+
+// Compresses len bytes of data and writes out whatever is ready.
+void write_output(Writer *writer, char *data, size_t len, bool finish) {
+  if (writer->failed) {
+    return;
+  }
+
+  switch (writer->compression) {
+  case COMPRESSION_NONE:
+    write_bytes(writer, data, len);
+    break;
+  case COMPRESSION_GZIP: {
+    z_stream *z = &writer->gzip;
+    z->next_in = (unsigned char *)data;
+    z->avail_in = len;
+    do {
+      z->next_out = writer->out;
+      z->avail_out = WRITE_BATCH;
+      if (deflate(z, finish ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) {
+        fail_writer(writer, "Could not compress");
+        return;
+      }
+      write_bytes(writer, writer->out, WRITE_BATCH - z->avail_out);
+    } while (z->avail_out == 0 && !writer->failed);
+    break;
+  }
+  case COMPRESSION_ZSTD: {
+    ZSTD_inBuffer input = {data, len, 0};
+    ZSTD_EndDirective mode = finish ? ZSTD_e_end : ZSTD_e_continue;
+    size_t remaining;
+    do {
+      ZSTD_outBuffer output = {writer->out, WRITE_BATCH, 0};
+      remaining = ZSTD_compressStream2(writer->zstd, &output, &input, mode);
+      if (ZSTD_isError(remaining)) {
+        fail_writer(writer, "Could not compress");
+        return;
+      }
+      write_bytes(writer, writer->out, output.pos);
+    } while (!writer->failed &&
+             (finish ? remaining != 0 : input.pos < input.size));
+    break;
+  }
+  }
+}
+
+/*
+ * Finishes the file and moves it over the old one. Returns false, leaving the
+ * old file as it was, if anything went wrong on the way.
+ */
+bool close_writer(Writer *writer) {
+  write_output(writer, "", 0, true);
+  if (writer->compression == COMPRESSION_GZIP) {
+    deflateEnd(&writer->gzip);
+  }
+  ZSTD_freeCCtx(writer->zstd);
+  if (writer->file != NULL) {
+    if (fflush(writer->file) != 0 || fsync(fileno(writer->file)) != 0) {
+      fail_writer(writer, "Could not write file");
+    }
+    if (fclose(writer->file) != 0) {
+      fail_writer(writer, "Could not write file");
+    }
+  }
+  if (!writer->failed && rename(writer->temp, writer->path) != 0) {
+    fail_writer(writer, "Could not replace file");
+  }
+  if (writer->failed) {
+    unlink(writer->temp);
+  }
+
+  bool ok = !writer->failed;
+  free(writer->temp);
+  free(writer->out);
+  free(writer);
+  return ok;
+}
+
+void flush_string(Writer *writer, string *s) {
+  writer->hash = hash_bytes(writer->hash, s->str, s->len);
+  write_output(writer, s->str, s->len, false);
+  s->len = 0;
+}
+
+void write_node(Writer *writer, string *s, Node *node, int parent_id) {
+  if (serialize_entry(node, parent_id, s)) {
+    for (int i = 0; i < node->n_children; i++) {
+      write_node(writer, s, node->children[i], node->id);
+    }
+  }
+
+  if (s->len >= WRITE_BATCH) {
+    flush_string(writer, s);
+  }
+}
+
+/*
+ * Streams the children of node to path in the same text as serialize_tree,
+ * compressing on the way. Stores the hash of the text in hash.
+ */
+bool write_tree(char *path, Node *node, int *hash) {
+  Writer *writer = open_writer(path, output_compression(path));
+  if (writer == NULL) {
+    return false;
+  }
+
+  string s;
+  s.str = malloc(WRITE_BATCH + 1000);
+  s.size = WRITE_BATCH + 1000;
+  s.len = 0;
+
+  for (int i = 0; i < node->n_children; i++) {
+    write_node(writer, &s, node->children[i], node->id);
+  }
+  flush_string(writer, &s);
+  free(s.str);
+
+  *hash = writer->hash;
+  return close_writer(writer);
+}
+
+// Writes the main file and every modified shard to its own file.
+void save_tree(Tree *tree) {
+  TRACE_BEGIN(start);
+  int hash;
+  if (write_tree(filename, tree->root, &hash)) {
+    current_hash = hash;
+    saved_version = edit_version;
+  }
+
+  for (int i = 0; i < loaded_mounts.len; i++) {
+    Node *node = loaded_mounts.nodes[i];
+    if (node->mount_dirty && check_if_descendent(tree->root, node) &&
+        write_tree(node->mount, node, &hash)) {
+      node->mount_dirty = false;
+    }
+  }
+  TRACE_END(start, "save_tree", NULL);
+}
+
+void free_tree(Tree *tree) {
+  free_subtree(tree, tree->root);
+  g_hash_table_destroy(tree->nodes);
+  free(tree);
+}
+
+bool same_string(char *a, char *b) {
+  return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+bool same_children(Node *node, Node *source) {
+  if (node->n_children != source->n_children) {
+    return false;
+  }
+  for (int i = 0; i < node->n_children; i++) {
+    if (node->children[i]->id != source->children[i]->id) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool same_fields(Node *node, Node *source) {
+  return strcmp(node->name, source->name) == 0 &&
+         node->color == source->color &&
+         same_string(node->filename, source->filename) &&
+         same_string(node->mount, source->mount);
+}
+
+/*
+ * Lists the nodes of source that are new or differ from base, an earlier read
+ * of the same file, or all of them without a base. A node gone from the file
+ * needs no entry, as its old parent is listed with the children it has now.
+ */
+void diff_trees(Tree *base, Tree *source, NodeList *changed) {
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, source->nodes);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    Node *from = (Node *)value;
+    Node *old = base != NULL ? find_node(base, from->id) : NULL;
+    if (old == NULL || !same_fields(old, from) || !same_children(old, from)) {
+      append_node(changed, from);
+    }
+  }
+}
+
+void patch_fields(Tree *tree, Node *node, Node *source) {
+  if (strcmp(node->name, source->name) != 0) {
+    release(node->name);
+    node->name = retain(source->name);
+    node->text_font_size = 0;
+    invalidate_size(node);
+  }
+
+  node->color = source->color;
+
+  if (!same_string(node->filename, source->filename)) {
+    release(node->filename);
+    node->filename = retain(source->filename);
+  }
+
+  if (!same_string(node->mount, source->mount)) {
+    if (node->mount_loaded) {
+      unload_mount(tree, node);
+    }
+    free(node->mount);
+    node->mount = source->mount ? strdup(source->mount) : NULL;
+  }
+}
+
+// Frees a node that is gone from the file, with the children that stayed.
+void free_removed(Tree *tree, Node *node) {
+  for (int i = 0; i < node->n_children; i++) {
+    if (node->children[i]->parent == node) {
+      free_removed(tree, node->children[i]);
+    }
+  }
+  node->n_children = 0;
+
+  if (node == selected_node) {
+    selected_node = NULL;
+  }
+  for (guint i = 0; views != NULL && i < views->len; i++) {
+    View *v = g_ptr_array_index(views, i);
+    if (v->draw_root == node) {
+      v->draw_root = tree->root;
+    }
+  }
+  free_subtree(tree, node);
+}
+
+void recount_descendents(Node *node, GHashTable *dirty) {
+  if (!g_hash_table_contains(dirty, node)) {
+    return;
+  }
+
+  node->n_descendents = 0;
+  node->offsets_dirty = true;
+  for (int i = 0; i < node->n_children; i++) {
+    recount_descendents(node->children[i], dirty);
+    node->n_descendents += node->children[i]->n_descendents + 1;
+  }
+}
+
+// Whether node was read from a loaded shard rather than the main file.
+bool in_loaded_shard(Node *node) {
+  for (Node *n = node->parent; n != NULL; n = n->parent) {
+    if (n->mount_loaded) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Finds the node of tree that stands for a node of the main file. A shard
+ * node holding the same id moves to a fresh one, like a clash in load_mount,
+ * which leaves its shard modified.
+ */
+Node *find_file_node(Tree *tree, Tree *source, int id) {
+  Node *node = find_node(tree, id);
+  if (node == NULL || !in_loaded_shard(node)) {
+    return node;
+  }
+
+  g_hash_table_remove(tree->nodes, GINT_TO_POINTER(id));
+  int fresh = get_unused_id(tree);
+  while (find_node(source, fresh) != NULL) {
+    tree->next_id++;
+    fresh = get_unused_id(tree);
+  }
+  node->id = fresh;
+  register_node(tree, node);
+  touch_shard(node->parent);
+  return NULL;
+}
+
+/*
+ * Brings tree in line with source, a tree just read from the same file,
+ * visiting only the nodes of source listed in sources. Nodes are matched by
+ * id. Fields are copied where they differ, only child lists that changed are
+ * relinked, and nodes missing from source are freed. Counts and sizes are
+ * redone only along the changed paths. Loaded shards are not part of the
+ * file and are left alone.
+ */
+void patch_tree(Tree *tree, Tree *source, NodeList *sources) {
+  NodeList changed = {NULL, 0, 0};
+  GHashTable *dirty = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  for (int i = 0; i < sources->len; i++) {
+    Node *from = sources->nodes[i];
+    Node *node = find_file_node(tree, source, from->id);
+    if (node == NULL) {
+      node = create_node(from->id, retain(from->name));
+      register_node(tree, node);
+      g_hash_table_add(dirty, node);
+    }
+    patch_fields(tree, node, from);
+    if (!node->mount_loaded && !same_children(node, from)) {
+      append_node(&changed, node);
+    }
+  }
+
+  NodeList removed = {NULL, 0, 0};
+  for (int i = 0; i < changed.len; i++) {
+    Node *node = changed.nodes[i];
+    Node *from = find_node(source, node->id);
+    for (int j = 0; j < node->n_children; j++) {
+      if (find_node(source, node->children[j]->id) == NULL) {
+        append_node(&removed, node->children[j]);
+      }
+    }
+
+    count_children(node->children_size, from->n_children);
+    free(node->children);
+    node->children = malloc(from->n_children * sizeof(Node *));
+    node->n_children = from->n_children;
+    node->children_size = from->n_children;
+    for (int j = 0; j < from->n_children; j++) {
+      node->children[j] = find_node(tree, from->children[j]->id);
+    }
+  }
+
+  for (int i = 0; i < changed.len; i++) {
+    Node *node = changed.nodes[i];
+    for (int j = 0; j < node->n_children; j++) {
+      node->children[j]->parent = node;
+      node->children[j]->index = j;
+    }
+    node->stale_from = G_MAXINT;
+  }
+  for (int i = 0; i < changed.len; i++) {
+    invalidate_size(changed.nodes[i]);
+    for (Node *n = changed.nodes[i]; n != NULL; n = n->parent) {
+      g_hash_table_add(dirty, n);
+    }
+  }
+  structure_version++;
+
+  for (int i = 0; i < removed.len; i++) {
+    free_removed(tree, removed.nodes[i]);
+  }
+  recount_descendents(tree->root, dirty);
+  if (selected_node == NULL) {
+    select_node(tree->root);
+  }
+
+  free(changed.nodes);
+  free(removed.nodes);
+  g_hash_table_destroy(dirty);
+}
+
+typedef struct MapRecord {
+  int id;
+  int value;
+  long offset;
+} MapRecord;
+
+typedef struct MapRecords {
+  MapRecord *records;
+  int len;
+  int size;
+} MapRecords;
+
+/*
+ * Index over a tree file mapped read-only into memory. Nodes are addressed
+ * by slot, their position in the sorted id array. Names, filenames and
+ * mounts stay in the mapping and are only referenced by offset, and the
+ * children of each slot are stored contiguously in file order.
+ */
+typedef struct MapIndex {
+  char *data;
+  size_t size;
+  int n;
+  int *ids;
+  long *names;
+  int *parents;
+  int *child_start;
+  int *children;
+  unsigned char *colors;
+  MapRecords files;
+  MapRecords mounts;
+} MapIndex;
+
+MapIndex *map_index = NULL;
+
+void append_map_record(MapRecords *list, MapRecord record) {
+  if (list->len == list->size) {
+    list->size = list->size == 0 ? 1024 : list->size * 2;
+    list->records = realloc(list->records, list->size * sizeof(MapRecord));
+  }
+  list->records[list->len++] = record;
+}
+
+int compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+int compare_map_records(const void *a, const void *b) {
+  return compare_ints(&((const MapRecord *)a)->id,
+                      &((const MapRecord *)b)->id);
+}
+
+// The mapping is not NUL terminated, so numbers are read up to end.
+bool scan_int(char **p, char *end, int *value) {
+  char *s = *p;
+  while (s < end && (*s == ' ' || *s == '\t')) {
+    s++;
+  }
+
+  bool negative = s < end && *s == '-';
+  if (negative) {
+    s++;
+  }
+  if (s == end || !isdigit((unsigned char)*s)) {
+    return false;
+  }
+
+  int v = 0;
+  for (; s < end && isdigit((unsigned char)*s); s++) {
+    v = v * 10 + (*s - '0');
+  }
+  *value = negative ? -v : v;
+  *p = s;
+  return true;
+}
+
+int find_map_slot(int id) {
+  int *found = bsearch(&id, map_index->ids, map_index->n, sizeof(int),
+                       compare_ints);
+  return found == NULL ? -1 : found - map_index->ids;
+}
+
+long map_offset(MapRecords *list, int slot) {
+  MapRecord key = {slot, 0, 0};
+  MapRecord *found = bsearch(&key, list->records, list->len,
+                             sizeof(MapRecord), compare_map_records);
+  return found == NULL ? -1 : found->offset;
+}
+
+void map_records_to_slots(MapRecords *list) {
+  int len = 0;
+  for (int i = 0; i < list->len; i++) {
+    int slot = find_map_slot(list->records[i].id);
+    if (slot >= 0) {
+      list->records[len] = list->records[i];
+      list->records[len++].id = slot;
+    }
+  }
+  list->len = len;
+  qsort(list->records, list->len, sizeof(MapRecord), compare_map_records);
+}
+
+/*
+ * Scans the mapped file once and builds the index. Lines that do not parse
+ * are skipped, since a browse session has nothing to write back.
+ */
+void build_map_index(char *data, size_t size) {
+  MapRecords edges = {NULL, 0, 0};
+  MapRecords names = {NULL, 0, 0};
+  MapRecords colors = {NULL, 0, 0};
+
+  map_index = malloc(sizeof(MapIndex));
+  map_index->data = data;
+  map_index->size = size;
+  map_index->files = (MapRecords){NULL, 0, 0};
+  map_index->mounts = (MapRecords){NULL, 0, 0};
+
+  char *end = data + size;
+  for (char *line = data; line < end;) {
+    char *newline = memchr(line, '\n', end - line);
+    if (newline == NULL) {
+      newline = end;
+    }
+
+    char *p = line;
+    while (p < newline && isspace((unsigned char)*p)) {
+      p++;
+    }
+    char *type = p;
+    while (p < newline && !isspace((unsigned char)*p)) {
+      p++;
+    }
+    int type_len = p - type;
+
+    MapRecord record = {0, 0, 0};
+    if (type_len == 4 && strncmp(type, "edge", 4) == 0) {
+      if (scan_int(&p, newline, &record.id) &&
+          scan_int(&p, newline, &record.value)) {
+        append_map_record(&edges, record);
+      }
+    } else if (type_len == 5 && strncmp(type, "color", 5) == 0) {
+      if (scan_int(&p, newline, &record.id) &&
+          scan_int(&p, newline, &record.value)) {
+        append_map_record(&colors, record);
+      }
+    } else if (scan_int(&p, newline, &record.id)) {
+      if (type_len == 4 && strncmp(type, "node", 4) == 0) {
+        char *name = memchr(p, '\t', newline - p);
+        record.offset = (name == NULL ? newline : name + 1) - data;
+        append_map_record(&names, record);
+      } else if ((type_len == 8 && strncmp(type, "filename", 8) == 0) ||
+                 (type_len == 5 && strncmp(type, "mount", 5) == 0)) {
+        // Paths run to the end of the line, like names, as they may hold
+        // spaces.
+        char *path = memchr(p, '\t', newline - p);
+        while (path == NULL && p < newline && isspace((unsigned char)*p)) {
+          p++;
+        }
+        record.offset = (path == NULL ? p : path + 1) - data;
+        append_map_record(type_len == 8 ? &map_index->files
+                                        : &map_index->mounts,
+                          record);
+      }
+    }
+
+    line = newline + 1;
+  }
+
+  int *ids = malloc((edges.len + 1) * sizeof(int));
+  ids[0] = 0;
+  for (int i = 0; i < edges.len; i++) {
+    ids[i + 1] = edges.records[i].value;
+  }
+  qsort(ids, edges.len + 1, sizeof(int), compare_ints);
+  int n = 0;
+  for (int i = 0; i <= edges.len; i++) {
+    if (n == 0 || ids[n - 1] != ids[i]) {
+      ids[n++] = ids[i];
+    }
+  }
+  map_index->ids = realloc(ids, n * sizeof(int));
+  map_index->n = n;
+
+  map_index->parents = malloc(n * sizeof(int));
+  map_index->child_start = calloc(n + 1, sizeof(int));
+  map_index->children = malloc((edges.len + 1) * sizeof(int));
+  for (int i = 0; i < n; i++) {
+    map_index->parents[i] = -1;
+  }
+  for (int i = 0; i < edges.len; i++) {
+    MapRecord *edge = &edges.records[i];
+    edge->id = find_map_slot(edge->id);
+    edge->value = find_map_slot(edge->value);
+    if (edge->id >= 0) {
+      map_index->child_start[edge->id + 1]++;
+      map_index->parents[edge->value] = edge->id;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    map_index->child_start[i + 1] += map_index->child_start[i];
+  }
+  int *cursor = malloc(n * sizeof(int));
+  memcpy(cursor, map_index->child_start, n * sizeof(int));
+  for (int i = 0; i < edges.len; i++) {
+    MapRecord *edge = &edges.records[i];
+    if (edge->id >= 0) {
+      map_index->children[cursor[edge->id]++] = edge->value;
+    }
+  }
+  free(cursor);
+
+  map_index->names = malloc(n * sizeof(long));
+  for (int i = 0; i < n; i++) {
+    map_index->names[i] = -1;
+  }
+  for (int i = 0; i < names.len; i++) {
+    int slot = find_map_slot(names.records[i].id);
+    if (slot >= 0) {
+      map_index->names[slot] = names.records[i].offset;
+    }
+  }
+
+  map_index->colors = calloc(n, 1);
+  for (int i = 0; i < colors.len; i++) {
+    int slot = find_map_slot(colors.records[i].id);
+    if (slot >= 0) {
+      map_index->colors[slot] = colors.records[i].value;
+    }
+  }
+
+  map_records_to_slots(&map_index->files);
+  map_records_to_slots(&map_index->mounts);
+
+  free(edges.records);
+  free(names.records);
+  free(colors.records);
+}
+
+void open_map_index(char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("Could not open file %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    printf("Could not read file %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  char *data = NULL;
+  if (st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      printf("Could not map file %s\n", path);
+      exit(EXIT_FAILURE);
+    }
+  }
+  close(fd);
+
+  if (detect_compression((unsigned char *)data, st.st_size) !=
+      COMPRESSION_NONE) {
+    printf("Compressed files cannot be browsed read-only: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  build_map_index(data, st.st_size);
+}
+
+// Copies the rest of the line at offset in the mapping.
+char *map_string(long offset) {
+  if (offset < 0) {
+    return NULL;
+  }
+
+  char *start = map_index->data + offset;
+  char *end = map_index->data + map_index->size;
+  char *p = start;
+  while (p < end && *p != '\n') {
+    p++;
+  }
+  return strndup(start, p - start);
+}
+
+void fill_mapped_node(Node *node, int slot) {
+  char *name = map_string(map_index->names[slot]);
+  if (name != NULL) {
+    assign_string(&node->name, name);
+    free(name);
+  } else if (node->name == NULL) {
+    node->name = intern("New Node");
+  }
+  node->color = map_index->colors[slot];
+  char *filename = map_string(map_offset(&map_index->files, slot));
+  if (filename != NULL) {
+    assign_string(&node->filename, filename);
+    free(filename);
+  }
+  node->mount = map_string(map_offset(&map_index->mounts, slot));
+  node->map_slot = slot;
+}
+
+bool has_hidden_children(Node *node) {
+  if (node->mount != NULL && !node->mount_loaded) {
+    return true;
+  }
+
+  int slot = node->map_slot;
+  return slot >= 0 && !node->map_expanded &&
+         map_index->child_start[slot + 1] > map_index->child_start[slot];
+}
+
+// Creates the children of a mapped node from the index.
+void expand_mapped(Tree *tree, Node *node) {
+  if (node->map_slot < 0 || node->map_expanded) {
+    return;
+  }
+  node->map_expanded = true;
+
+  int slot = node->map_slot;
+  for (int i = map_index->child_start[slot];
+       i < map_index->child_start[slot + 1]; i++) {
+    int child_slot = map_index->children[i];
+    Node *child = create_node(map_index->ids[child_slot], NULL);
+    fill_mapped_node(child, child_slot);
+    add_child(node, child);
+    register_node(tree, child);
+  }
+}
+
+void expand_node(Tree *tree, Node *node) {
+  load_mount(tree, node);
+  expand_mapped(tree, node);
+}
+
+bool match_span(char *name, size_t len, char *pattern) {
+  size_t i = 0;
+  size_t pattern_len = strlen(pattern);
+  for (size_t j = 0; j < len && i < pattern_len; j++) {
+    if (tolower(name[j]) == tolower(pattern[i])) {
+      i++;
+    }
+  }
+
+  return i == pattern_len;
+}
+
+/*
+ * Searches the names in the mapping and materializes the chain of nodes
+ * leading to the first match. Returns NULL when nothing matches.
+ */
+Node *map_search(Tree *tree, char *pattern) {
+  int slot = -1;
+  char *end = map_index->data + map_index->size;
+  for (int i = 0; i < map_index->n && slot < 0; i++) {
+    if (map_index->names[i] >= 0) {
+      char *name = map_index->data + map_index->names[i];
+      char *newline = memchr(name, '\n', end - name);
+      size_t len = (newline == NULL ? end : newline) - name;
+      if (match_span(name, len, pattern)) {
+        slot = i;
+      }
+    }
+  }
+  if (slot < 0) {
+    return NULL;
+  }
+
+  int depth = 0;
+  int ancestor = slot;
+  Node *node = find_node(tree, map_index->ids[slot]);
+  while (node == NULL && map_index->parents[ancestor] >= 0) {
+    ancestor = map_index->parents[ancestor];
+    node = find_node(tree, map_index->ids[ancestor]);
+    depth++;
+  }
+
+  int *slots = malloc((depth + 1) * sizeof(int));
+  for (int i = depth - 1, s = slot; i >= 0; i--, s = map_index->parents[s]) {
+    slots[i] = s;
+  }
+  for (int i = 0; node != NULL && i < depth; i++) {
+    expand_mapped(tree, node);
+    node = find_node(tree, map_index->ids[slots[i]]);
+  }
+  free(slots);
+
+  return node;
+}
+
+bool intersects(Rectangle a, Rectangle b) {
+  return a.x1 <= b.x2 && a.x2 >= b.x1 && a.y1 <= b.y2 && a.y2 >= b.y1;
+}
+
+void rect_path(cairo_t *cr, Rectangle rect) {
+  cairo_rectangle(cr, rect.x1, rect.y1, rect.x2 - rect.x1, rect.y2 - rect.y1);
+}
+
+void circle_path(cairo_t *cr, double x, double y, double radius) {
+  cairo_new_sub_path(cr);
+  cairo_arc(cr, x, y, radius, 0, 2 * M_PI);
+}
+
+double mid_x(Rectangle rect) { return (rect.x1 + rect.x2) / 2; }
+
+double mid_y(Rectangle rect) { return (rect.y1 + rect.y2) / 2; }
+
+// Where the connectors from node to its children start.
+void out_port(Node *node, double *x, double *y) {
+  switch (layout_style) {
+  case LAYOUT_TOP_DOWN:
+    *x = mid_x(node->rect);
+    *y = node->rect.y2;
+    break;
+  case LAYOUT_RADIAL:
+    *x = mid_x(node->rect);
+    *y = mid_y(node->rect);
+    break;
+  default:
+    *x = node->rect.x2;
+    *y = mid_y(node->rect);
+    break;
+  }
+}
+
+// Where the connector from the parent of node ends.
+void in_port(Node *node, double *x, double *y) {
+  switch (layout_style) {
+  case LAYOUT_TOP_DOWN:
+    *x = mid_x(node->rect);
+    *y = node->rect.y1;
+    break;
+  case LAYOUT_RADIAL:
+    *x = mid_x(node->rect);
+    *y = mid_y(node->rect);
+    break;
+  default:
+    *x = node->rect.x1;
+    *y = mid_y(node->rect);
+    break;
+  }
+}
+
+void connector_path(cairo_t *cr, Node *parent, Node *node) {
+  double x1, y1, x2, y2;
+  out_port(parent, &x1, &y1);
+  in_port(node, &x2, &y2);
+
+  if (layout_style == LAYOUT_RADIAL) {
+    cairo_move_to(cr, x1, y1);
+    cairo_line_to(cr, x2, y2);
+  } else if (layout_style == LAYOUT_TOP_DOWN) {
+    y1 += connector_radius;
+    y2 -= connector_radius;
+    double ym = (y1 + y2) / 2;
+    cairo_move_to(cr, x1, y1);
+    cairo_curve_to(cr, x1, ym, x2, ym, x2, y2);
+  } else {
+    x1 += connector_radius;
+    x2 -= connector_radius;
+    double xm = (x1 + x2) / 2;
+    cairo_move_to(cr, x1, y1);
+    cairo_curve_to(cr, xm, y1, xm, y2, x2, y2);
+  }
+}
+
+void set_band_color(cairo_t *cr, int color) {
+  switch (color) {
+  case 1:
+    cairo_set_source_rgba(cr, 0.0, 1.0, 0.0, 0.15);
+    break;
+  case 2:
+    cairo_set_source_rgba(cr, 1.0, 0.0, 0.0, 0.15);
+    break;
+  case 3:
+    cairo_set_source_rgba(cr, 0.0, 0.0, 1.0, 0.15);
+    break;
+  }
+}
+
+double node_width(Node *node) { return node->text_width + 2 * xpad; }
+
+double node_height() { return font_size + 2 * ypad; }
+
+/*
+ * Pango contexts are not thread safe, so each layout worker shapes text with
+ * its own font map.
+ */
+PangoContext *get_text_context() {
+  PangoContext *context = g_private_get(&text_context);
+  if (context == NULL) {
+    PangoFontMap *font_map = pango_cairo_font_map_new();
+    context = pango_font_map_create_context(font_map);
+    g_object_unref(font_map);
+    g_private_set(&text_context, context);
+  }
+  return context;
+}
+
+void update_text_font() {
+  if (text_font == NULL) {
+    text_font = pango_font_description_from_string("Sans");
+  }
+  pango_font_description_set_absolute_size(text_font, font_size * PANGO_SCALE);
+}
+
+/*
+ * Shapes the name of node into a layout that is kept until the name or the
+ * font size changes, so drawing a frame does not shape any text.
+ */
+void measure_node(Node *node) {
+  if (node->text_font_size == font_size) {
+    return;
+  }
+
+  PangoContext *context = get_text_context();
+  if (node->layout != NULL &&
+      pango_layout_get_context(node->layout) != context) {
+    g_object_unref(node->layout);
+    node->layout = NULL;
+    g_atomic_pointer_add(&live_layouts, -1);
+  }
+  if (node->layout == NULL) {
+    node->layout = pango_layout_new(context);
+    g_atomic_pointer_add(&live_layouts, 1);
+    pango_layout_set_single_paragraph_mode(node->layout, TRUE);
+    if (max_text_width > 0) {
+      pango_layout_set_width(node->layout, max_text_width * PANGO_SCALE);
+      pango_layout_set_ellipsize(node->layout, PANGO_ELLIPSIZE_END);
+    }
+  }
+
+  if (strcmp(pango_layout_get_text(node->layout), node->name) != 0) {
+    pango_layout_set_text(node->layout, node->name, -1);
+  }
+  pango_layout_set_font_description(node->layout, text_font);
+
+  PangoRectangle extents;
+  pango_layout_get_extents(node->layout, NULL, &extents);
+  node->text_width = (double)extents.width / PANGO_SCALE;
+  node->text_font_size = font_size;
+}
+
+// Assumes the subtree heights of the children are already known.
+void size_node(Node *node) {
+  measure_node(node);
+
+  double children_height = 0;
+  for (int i = 0; i < node->n_children; i++) {
+    if (i > 0) {
+      children_height += ymargin;
+    }
+    children_height += node->children[i]->subtree_height;
+  }
+
+  node->subtree_height = fmax(node_height(), children_height);
+  node->size_dirty = false;
+}
+
+// Skips subtrees that have not changed since they were last sized.
+void size_subtree(void *item, void *data) {
+  Node *node = (Node *)item;
+  if (!node->size_dirty && !layout_full) {
+    return;
+  }
+
+  for (int i = 0; i < node->n_children; i++) {
+    size_subtree(node->children[i], data);
+  }
+  size_node(node);
+}
+
+void place_children(Node *node) {
+  double y = node->rect.y1;
+  for (int i = 0; i < node->n_children; i++) {
+    Node *child = node->children[i];
+    double x = node->rect.x2 + xmargin;
+    child->rect = (Rectangle){x, y, x + node_width(child), y + node_height()};
+    y += child->subtree_height + ymargin;
+  }
+}
+
+// Assumes the extents of the children are already known.
+void update_extent(Node *node) {
+  Rectangle extent = node->rect;
+  for (int i = 0; i < node->n_children; i++) {
+    Rectangle child = node->children[i]->subtree_rect;
+    extent.x1 = fmin(extent.x1, child.x1);
+    extent.y1 = fmin(extent.y1, child.y1);
+    extent.x2 = fmax(extent.x2, child.x2);
+    extent.y2 = fmax(extent.y2, child.y2);
+  }
+  node->subtree_rect = extent;
+}
+
+void place_subtree(void *item, void *data) {
+  Node *node = (Node *)item;
+  place_children(node);
+  for (int i = 0; i < node->n_children; i++) {
+    place_subtree(node->children[i], data);
+  }
+  update_extent(node);
+}
+
+/*
+ * Scratch state of the tidy layout. The nodes are kept in breadth-first
+ * order, so the children of a node are consecutive and come after it.
+ */
+typedef struct TidyNode {
+  Node *node;
+  int parent;
+  int first_child;
+  int number;
+  int level;
+  int thread;
+  int ancestor;
+  double size;
+  double prelim;
+  double mod;
+  double shift;
+  double change;
+  double offset;
+} TidyNode;
+
+typedef struct Tidy {
+  TidyNode *nodes;
+  int len;
+  double gap;
+} Tidy;
+
+int tidy_next_left(Tidy *tidy, int v) {
+  TidyNode *t = &tidy->nodes[v];
+  return t->node->n_children > 0 ? t->first_child : t->thread;
+}
+
+int tidy_next_right(Tidy *tidy, int v) {
+  TidyNode *t = &tidy->nodes[v];
+  return t->node->n_children > 0 ? t->first_child + t->node->n_children - 1
+                                 : t->thread;
+}
+
+// The distance between the centers of two neighbours on the same level.
+double tidy_distance(Tidy *tidy, int a, int b) {
+  return (tidy->nodes[a].size + tidy->nodes[b].size) / 2 + tidy->gap;
+}
+
+void tidy_move_subtree(Tidy *tidy, int wm, int wp, double shift) {
+  TidyNode *m = &tidy->nodes[wm];
+  TidyNode *p = &tidy->nodes[wp];
+  double subtrees = p->number - m->number;
+  p->change -= shift / subtrees;
+  p->shift += shift;
+  m->change += shift / subtrees;
+  p->prelim += shift;
+  p->mod += shift;
+}
+
+/*
+ * Pushes the subtree of v clear of its left siblings' subtrees by walking
+ * the facing contours, and spreads the shift over the siblings in between.
+ * Contours that run out are threaded onto the deeper side, which keeps the
+ * whole layout linear. This is Walker's algorithm in the linear time form
+ * given by Buchheim et al.
+ */
+int tidy_apportion(Tidy *tidy, int v, int default_ancestor) {
+  TidyNode *t = tidy->nodes;
+  if (t[v].number == 0) {
+    return default_ancestor;
+  }
+
+  int vip = v;
+  int vop = v;
+  int vim = v - 1;
+  int vom = v - t[v].number;
+  double sip = t[vip].mod;
+  double sop = t[vop].mod;
+  double sim = t[vim].mod;
+  double som = t[vom].mod;
+
+  while (tidy_next_right(tidy, vim) >= 0 && tidy_next_left(tidy, vip) >= 0) {
+    vim = tidy_next_right(tidy, vim);
+    vip = tidy_next_left(tidy, vip);
+    vom = tidy_next_left(tidy, vom);
+    vop = tidy_next_right(tidy, vop);
+    t[vop].ancestor = v;
+
+    double shift = t[vim].prelim + sim - (t[vip].prelim + sip) +
+                   tidy_distance(tidy, vim, vip);
+    if (shift > 0) {
+      int ancestor = t[vim].ancestor;
+      if (t[ancestor].parent != t[v].parent) {
+        ancestor = default_ancestor;
+      }
+      tidy_move_subtree(tidy, ancestor, v, shift);
+      sip += shift;
+      sop += shift;
+    }
+    sim += t[vim].mod;
+    sip += t[vip].mod;
+    som += t[vom].mod;
+    sop += t[vop].mod;
+  }
+
+  if (tidy_next_right(tidy, vim) >= 0 && tidy_next_right(tidy, vop) < 0) {
+    t[vop].thread = tidy_next_right(tidy, vim);
+    t[vop].mod += sim - sop;
+  }
+  if (tidy_next_left(tidy, vip) >= 0 && tidy_next_left(tidy, vom) < 0) {
+    t[vom].thread = tidy_next_left(tidy, vip);
+    t[vom].mod += sip - som;
+    default_ancestor = v;
+  }
+  return default_ancestor;
+}
+
+void tidy_execute_shifts(Tidy *tidy, int v) {
+  TidyNode *t = tidy->nodes;
+  double shift = 0;
+  double change = 0;
+  int first = t[v].first_child;
+  for (int w = first + t[v].node->n_children - 1; w >= first; w--) {
+    t[w].prelim += shift;
+    t[w].mod += shift;
+    change += t[w].change;
+    shift += t[w].shift + change;
+  }
+}
+
+// Centers a node over its children, or puts it next to its left sibling.
+void tidy_place(Tidy *tidy, int v) {
+  TidyNode *t = tidy->nodes;
+  double midpoint = 0;
+  if (t[v].node->n_children > 0) {
+    int first = t[v].first_child;
+    int last = first + t[v].node->n_children - 1;
+    midpoint = (t[first].prelim + t[last].prelim) / 2;
+  }
+
+  if (t[v].number > 0) {
+    t[v].prelim = t[v - 1].prelim + tidy_distance(tidy, v - 1, v);
+    t[v].mod = t[v].prelim - midpoint;
+  } else {
+    t[v].prelim = midpoint;
+  }
+}
+
+/*
+ * Lays the subtree under root out as a tidy tree: every level gets its own
+ * column (or row), and subtrees are packed as closely as their contours
+ * allow instead of each taking a band of its own. The radial style wraps
+ * the same arrangement around the root.
+ */
+void tidy_layout(Node *root, double x, double y) {
+  bool top_down = layout_style == LAYOUT_TOP_DOWN;
+  Tidy tidy;
+  tidy.gap = top_down ? xmargin / 4 : ymargin;
+
+  int size = 1024;
+  int len = 1;
+  int levels = 1;
+  TidyNode *t = malloc(size * sizeof(TidyNode));
+  if (t == NULL) {
+    printf("Could not allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+  t[0] = (TidyNode){.node = root, .parent = -1, .thread = -1};
+  for (int i = 0; i < len; i++) {
+    Node *node = t[i].node;
+    if (len + node->n_children > size) {
+      while (len + node->n_children > size) {
+        size *= 2;
+      }
+      t = realloc(t, size * sizeof(TidyNode));
+      if (t == NULL) {
+        printf("Could not allocate memory\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    t[i].size = top_down ? node_width(node) : node_height();
+    t[i].first_child = len;
+    for (int j = 0; j < node->n_children; j++) {
+      t[len] = (TidyNode){.node = node->children[j],
+                          .parent = i,
+                          .number = j,
+                          .level = t[i].level + 1,
+                          .thread = -1,
+                          .ancestor = len};
+      len++;
+    }
+    if (t[i].level + 1 > levels) {
+      levels = t[i].level + 1;
+    }
+  }
+  tidy.nodes = t;
+  tidy.len = len;
+
+  for (int v = len - 1; v >= 0; v--) {
+    int n_children = t[v].node->n_children;
+    if (n_children == 0) {
+      continue;
+    }
+    int default_ancestor = t[v].first_child;
+    for (int w = t[v].first_child; w < t[v].first_child + n_children; w++) {
+      tidy_place(&tidy, w);
+      default_ancestor = tidy_apportion(&tidy, w, default_ancestor);
+    }
+    tidy_execute_shifts(&tidy, v);
+  }
+  tidy_place(&tidy, 0);
+
+  double *level_size = calloc(levels, sizeof(double));
+  double *level_start = malloc(levels * sizeof(double));
+  if (level_size == NULL || level_start == NULL) {
+    printf("Could not allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+  double low = 0;
+  double high = 0;
+  for (int v = 0; v < len; v++) {
+    if (v > 0) {
+      TidyNode *parent = &t[t[v].parent];
+      t[v].offset = parent->offset + parent->mod;
+    }
+    t[v].prelim += t[v].offset;
+    low = fmin(low, t[v].prelim - t[v].size / 2);
+    high = fmax(high, t[v].prelim + t[v].size / 2);
+
+    double size = top_down ? node_height() : node_width(t[v].node);
+    level_size[t[v].level] = fmax(level_size[t[v].level], size);
+  }
+
+  double gap = top_down ? 4 * ymargin : xmargin;
+  level_start[0] = 0;
+  for (int level = 1; level < levels; level++) {
+    level_start[level] = level_start[level - 1] + level_size[level - 1] + gap;
+  }
+
+  double scale = 1;
+  if (layout_style == LAYOUT_RADIAL && levels > 1) {
+    // Keep the outermost ring long enough for its nodes.
+    double ring = 2 * M_PI * level_start[levels - 1];
+    scale = fmax(1, (high - low + tidy.gap) / ring);
+  }
+
+  for (int v = 0; v < len; v++) {
+    Node *node = t[v].node;
+    double width = node_width(node);
+    double height = node_height();
+    double along = t[v].prelim - low;
+    double across = level_start[t[v].level];
+    if (layout_style == LAYOUT_RADIAL) {
+      double angle = 2 * M_PI * along / (high - low + tidy.gap);
+      double radius = across * scale;
+      double cx = radius * cos(angle);
+      double cy = radius * sin(angle);
+      node->rect = (Rectangle){cx - width / 2, cy - height / 2, cx + width / 2,
+                               cy + height / 2};
+    } else if (top_down) {
+      node->rect = (Rectangle){along - width / 2, across, along + width / 2,
+                               across + height};
+    } else {
+      node->rect = (Rectangle){across, along - height / 2, across + width,
+                               along + height / 2};
+    }
+  }
+
+  for (int v = len - 1; v >= 0; v--) {
+    update_extent(t[v].node);
+  }
+
+  // Move the top left corner of the whole drawing to x, y.
+  double dx = x - root->subtree_rect.x1;
+  double dy = y - root->subtree_rect.y1;
+  for (int v = 0; v < len; v++) {
+    Node *node = t[v].node;
+    node->rect = (Rectangle){node->rect.x1 + dx, node->rect.y1 + dy,
+                             node->rect.x2 + dx, node->rect.y2 + dy};
+    node->subtree_rect =
+        (Rectangle){node->subtree_rect.x1 + dx, node->subtree_rect.y1 + dy,
+                    node->subtree_rect.x2 + dx, node->subtree_rect.y2 + dy};
+  }
+
+  free(level_size);
+  free(level_start);
+  free(tidy.nodes);
+}
+
+/*
+ * Expands the top of the tree breadth-first until there are enough independent
+ * subtrees to keep the worker pool busy. The expanded nodes end up in top, in
+ * breadth-first order, and the subtrees left to the workers in frontier.
+ */
+void split_layout(Node *root, NodeList *top, NodeList *frontier, int target) {
+  append_node(frontier, root);
+
+  for (int depth = 0; depth < 16 && frontier->len < target; depth++) {
+    NodeList next = {NULL, 0, 0};
+    bool expanded = false;
+    for (int i = 0; i < frontier->len; i++) {
+      Node *node = frontier->nodes[i];
+      if (node->n_children == 0) {
+        append_node(&next, node);
+      } else {
+        append_node(top, node);
+        for (int j = 0; j < node->n_children; j++) {
+          append_node(&next, node->children[j]);
+        }
+        expanded = true;
+      }
+    }
+    free(frontier->nodes);
+    *frontier = next;
+
+    if (!expanded) {
+      break;
+    }
+  }
+}
+
+/*
+ * Lays out the subtree under root in two passes: subtree heights bottom-up,
+ * then positions top-down. Both passes run in parallel over the subtrees below
+ * the first few levels, and text is measured as part of the first pass.
+ */
+void layout_tree(Node *root, double x, double y) {
+  update_text_font();
+  int threads = g_get_num_processors();
+
+  NodeList top = {NULL, 0, 0};
+  NodeList frontier = {NULL, 0, 0};
+  if (threads > 1) {
+    split_layout(root, &top, &frontier, threads * 8);
+  } else {
+    append_node(&frontier, root);
+  }
+
+  run_parallel(size_subtree, (void **)frontier.nodes, frontier.len, NULL);
+  for (int i = top.len - 1; i >= 0; i--) {
+    size_node(top.nodes[i]);
+  }
+
+  if (layout_style != LAYOUT_STACKED) {
+    tidy_layout(root, x, y);
+    free(top.nodes);
+    free(frontier.nodes);
+    return;
+  }
+
+  root->rect = (Rectangle){x, y, x + node_width(root), y + node_height()};
+  for (int i = 0; i < top.len; i++) {
+    place_children(top.nodes[i]);
+  }
+  run_parallel(place_subtree, (void **)frontier.nodes, frontier.len, NULL);
+  for (int i = top.len - 1; i >= 0; i--) {
+    update_extent(top.nodes[i]);
+  }
+
+  free(top.nodes);
+  free(frontier.nodes);
+}
+
+Node *common_ancestor(Node *a, Node *b) {
+  int depth_a = 0;
+  int depth_b = 0;
+  for (Node *node = a; node->parent != NULL; node = node->parent) {
+    depth_a++;
+  }
+  for (Node *node = b; node->parent != NULL; node = node->parent) {
+    depth_b++;
+  }
+
+  for (; depth_a > depth_b; depth_a--) {
+    a = a->parent;
+  }
+  for (; depth_b > depth_a; depth_b--) {
+    b = b->parent;
+  }
+  while (a != b) {
+    a = a->parent;
+    b = b->parent;
+  }
+  return a;
+}
+
+// The smallest subtree that holds the roots of all views.
+Node *views_root() {
+  Node *root = view->draw_root;
+  for (guint i = 0; i < views->len; i++) {
+    View *v = g_ptr_array_index(views, i);
+    root = common_ancestor(root, v->draw_root);
+  }
+  return root;
+}
+
+/*
+ * Lays out the smallest subtree that holds the roots of all views. Each view
+ * then draws its own part of the shared geometry. The layout is only redone
+ * after an edit to the structure, a name or the style.
+ */
+void update_layout() {
+  Node *root = views_root();
+
+  if (!layout_dirty && layout_root == root &&
+      layout_structure == structure_version &&
+      layout_font_size == font_size) {
+    return;
+  }
+
+  TRACE_BEGIN(start);
+  layout_full = layout_font_size != font_size;
+  layout_tree(root, 100, 100);
+  TRACE_END(start, "layout", layout_full ? "full" : NULL);
+
+  layout_dirty = false;
+  layout_structure = structure_version;
+  layout_root = root;
+  layout_extent = root->subtree_rect;
+  layout_font_size = font_size;
+  layout_version++;
+}
+
+/*
+ * Returns how far the geometry of v has to move so that its root sits where
+ * the root of the shared layout does. It is zero when they are the same.
+ */
+void view_shift(View *v, double *dx, double *dy) {
+  *dx = layout_extent.x1 - v->draw_root->subtree_rect.x1;
+  *dy = layout_extent.y1 - v->draw_root->subtree_rect.y1;
+}
+
+// Maps a rectangle in layout coordinates to the view before it is panned.
+Rectangle to_view(View *v, Rectangle rect) {
+  double dx;
+  double dy;
+  view_shift(v, &dx, &dy);
+  return (Rectangle){(rect.x1 + dx) * v->zoom, (rect.y1 + dy) * v->zoom,
+                     (rect.x2 + dx) * v->zoom, (rect.y2 + dy) * v->zoom};
+}
+
+// Maps a rectangle in window coordinates back to layout coordinates.
+Rectangle to_layout(View *v, double x1, double y1, double x2, double y2) {
+  double dx;
+  double dy;
+  view_shift(v, &dx, &dy);
+  return (Rectangle){(x1 - v->x_offset) / v->zoom - dx,
+                     (y1 - v->y_offset) / v->zoom - dy,
+                     (x2 - v->x_offset) / v->zoom - dx,
+                     (y2 - v->y_offset) / v->zoom - dy};
+}
+
+/*
+ * Gathers the nodes that intersect the view, and the nodes whose connector to
+ * their parent does, so that each style can be drawn in a single cairo call.
+ * Subtrees whose extent lies outside the view are skipped.
+ */
+void collect_visible(Node *node, Node *parent, Rectangle view,
+                     NodeList *visible, NodeList *connected) {
+  if (intersects(node->rect, view)) {
+    append_node(visible, node);
+  }
+
+  if (parent != NULL) {
+    double x1, y1, x2, y2;
+    out_port(parent, &x1, &y1);
+    in_port(node, &x2, &y2);
+    Rectangle span = {fmin(x1, x2), fmin(y1, y2), fmax(x1, x2), fmax(y1, y2)};
+    if (intersects(span, view)) {
+      append_node(connected, node);
+    }
+  }
+
+  if (!intersects(node->subtree_rect, view)) {
+    return;
+  }
+
+  for (int i = 0; i < node->n_children; i++) {
+    collect_visible(node->children[i], node, view, visible, connected);
+  }
+}
+
+void draw_tree(cairo_t *cr, Node *root, Rectangle view) {
+  NodeList visible = {NULL, 0, 0};
+  NodeList connected = {NULL, 0, 0};
+  collect_visible(root, NULL, view, &visible, &connected);
+
+  cairo_set_line_width(cr, 1);
+
+  for (int i = 0; i < connected.len; i++) {
+    Node *node = connected.nodes[i];
+    connector_path(cr, node->parent, node);
+  }
+  set_color(cr, COLOR_FOREGROUND, 1.0);
+  cairo_stroke(cr);
+
+  for (int i = 0; i < visible.len; i++) {
+    Node *node = visible.nodes[i];
+    if (node->filename != NULL) {
+      circle_path(cr, node->rect.x2, node->rect.y1, 5);
+    }
+  }
+  cairo_set_source_rgba(cr, 0.0, 1.0, 0.0, 0.15);
+  cairo_fill_preserve(cr);
+  set_color(cr, COLOR_FOREGROUND, 1.0);
+  cairo_stroke(cr);
+
+  for (int i = 0; i < visible.len; i++) {
+    Node *node = visible.nodes[i];
+    if (node->mount != NULL) {
+      rect_path(cr, (Rectangle){node->rect.x2 - 4, node->rect.y2 - 4,
+                                node->rect.x2 + 4, node->rect.y2 + 4});
+    }
+  }
+  set_color(cr, COLOR_ACCENT, 1.0);
+  cairo_fill_preserve(cr);
+  set_color(cr, COLOR_FOREGROUND, 1.0);
+  cairo_stroke(cr);
+
+  for (int i = 0; i < visible.len; i++) {
+    Node *node = visible.nodes[i];
+    double x, y;
+    if (node->parent != NULL) {
+      in_port(node, &x, &y);
+      circle_path(cr, x, y, connector_radius);
+    }
+    if (node->n_children != 0 || has_hidden_children(node)) {
+      out_port(node, &x, &y);
+      circle_path(cr, x, y, connector_radius);
+    }
+  }
+  set_color(cr, COLOR_ACCENT, 1.0);
+  cairo_fill_preserve(cr);
+  set_color(cr, COLOR_FOREGROUND, 1.0);
+  cairo_stroke(cr);
+
+  for (int i = 0; i < visible.len; i++) {
+    if (!visible.nodes[i]->selected && !is_marked(visible.nodes[i])) {
+      rect_path(cr, visible.nodes[i]->rect);
+    }
+  }
+  set_color(cr, COLOR_BACKGROUND, 1.0);
+  cairo_fill(cr);
+
+  for (int i = 0; i < visible.len; i++) {
+    if (visible.nodes[i]->selected || is_marked(visible.nodes[i])) {
+      rect_path(cr, visible.nodes[i]->rect);
+    }
+  }
+  set_color(cr, COLOR_ACCENT_FAINT, 1.0);
+  cairo_fill(cr);
+
+  for (int color = 1; color <= 3; color++) {
+    for (int i = 0; i < visible.len; i++) {
+      if (visible.nodes[i]->color == color) {
+        rect_path(cr, visible.nodes[i]->rect);
+      }
+    }
+    set_band_color(cr, color);
+    cairo_fill(cr);
+  }
+
+  set_color(cr, COLOR_FOREGROUND, 1.0);
+  for (int i = 0; i < visible.len; i++) {
+    Node *node = visible.nodes[i];
+    double baseline = pango_layout_get_baseline(node->layout);
+    cairo_move_to(cr, node->rect.x1 + xpad,
+                  node->rect.y1 + ypad + font_size - baseline / PANGO_SCALE);
+    pango_cairo_show_layout(cr, node->layout);
+  }
+
+  for (int i = 0; i < visible.len; i++) {
+    rect_path(cr, visible.nodes[i]->rect);
+  }
+  cairo_stroke(cr);
+
+  for (int i = 0; i < visible.len; i++) {
+    if (is_marked(visible.nodes[i])) {
+      rect_path(cr, visible.nodes[i]->rect);
+    }
+  }
+  set_color(cr, COLOR_ACCENT, 1.0);
+  cairo_stroke(cr);
+
+  free(visible.nodes);
+  free(connected.nodes);
+}
+
+void subtree_extent(Node *node, double *x2, double *y2) {
+  *x2 = fmax(*x2, node->rect.x2);
+  *y2 = fmax(*y2, node->rect.y2);
+  for (int i = 0; i < node->n_children; i++) {
+    subtree_extent(node->children[i], x2, y2);
+  }
+}
+
+void draw_region(cairo_t *cr, Node *root, Rectangle view) {
+  set_style();
+  set_color(cr, COLOR_BACKGROUND, 1.0);
+  cairo_paint(cr);
+  cairo_translate(cr, -view.x1, -view.y1);
+  draw_tree(cr, root, view);
+}
+
+bool region_has_nodes(Node *root, Rectangle view) {
+  NodeList visible = {NULL, 0, 0};
+  NodeList connected = {NULL, 0, 0};
+  collect_visible(root, NULL, view, &visible, &connected);
+  free(visible.nodes);
+  free(connected.nodes);
+  return visible.len + connected.len > 0;
+}
+
+void put_be32(unsigned char *p, unsigned long value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+void write_png_chunk(FILE *file, const char *type, unsigned char *data,
+                     size_t len) {
+  unsigned char header[8];
+  put_be32(header, len);
+  memcpy(header + 4, type, 4);
+  fwrite(header, 1, 8, file);
+  fwrite(data, 1, len, file);
+
+  uLong sum = crc32(0, header + 4, 4);
+  if (len > 0) {
+    sum = crc32(sum, data, len);
+  }
+  unsigned char crc[4];
+  put_be32(crc, sum);
+  fwrite(crc, 1, 4, file);
+}
+
+typedef struct PngWriter {
+  FILE *file;
+  z_stream z;
+  unsigned char *out;
+} PngWriter;
+
+void begin_png(PngWriter *png, FILE *file, int width, int height) {
+  png->file = file;
+  png->out = malloc(WRITE_BATCH);
+  memset(&png->z, 0, sizeof(z_stream));
+  deflateInit(&png->z, Z_DEFAULT_COMPRESSION);
+
+  fwrite("\x89PNG\r\n\x1a\n", 1, 8, file);
+  unsigned char header[13];
+  put_be32(header, width);
+  put_be32(header + 4, height);
+  header[8] = 8;
+  header[9] = 2;
+  header[10] = 0;
+  header[11] = 0;
+  header[12] = 0;
+  write_png_chunk(file, "IHDR", header, sizeof(header));
+}
+
+// Compresses filtered scanlines and writes the output as IDAT chunks.
+void write_png_rows(PngWriter *png, unsigned char *rows, size_t len,
+                    bool finish) {
+  png->z.next_in = rows;
+  png->z.avail_in = len;
+  do {
+    png->z.next_out = png->out;
+    png->z.avail_out = WRITE_BATCH;
+    deflate(&png->z, finish ? Z_FINISH : Z_NO_FLUSH);
+    size_t produced = WRITE_BATCH - png->z.avail_out;
+    if (produced > 0) {
+      write_png_chunk(png->file, "IDAT", png->out, produced);
+    }
+  } while (png->z.avail_out == 0);
+}
+
+void end_png(PngWriter *png) {
+  write_png_rows(png, NULL, 0, true);
+  deflateEnd(&png->z);
+  write_png_chunk(png->file, "IEND", NULL, 0);
+  free(png->out);
+}
+
+/*
+ * Renders the image in strips of full scanlines, each strip in tiles that fit
+ * a cairo image surface. Only one strip is held in memory at a time.
+ */
+void export_png(FILE *file, Node *root, int width, int height) {
+  size_t row_size = (size_t)width * 3 + 1;
+  int strip_height = EXPORT_BUDGET / row_size;
+  strip_height = strip_height < 1 ? 1 : strip_height;
+  strip_height = strip_height > EXPORT_TILE ? EXPORT_TILE : strip_height;
+  int tile_width = width < EXPORT_TILE ? width : EXPORT_TILE;
+
+  unsigned char *rows = malloc(row_size * strip_height);
+  cairo_surface_t *surface =
+      cairo_image_surface_create(CAIRO_FORMAT_RGB24, tile_width, strip_height);
+
+  PngWriter png;
+  begin_png(&png, file, width, height);
+
+  for (int y = 0; y < height; y += strip_height) {
+    int h = height - y < strip_height ? height - y : strip_height;
+    for (int x = 0; x < width; x += tile_width) {
+      int w = width - x < tile_width ? width - x : tile_width;
+
+      cairo_t *cr = cairo_create(surface);
+      draw_region(cr, root, (Rectangle){x, y, x + w, y + h});
+      cairo_destroy(cr);
+      cairo_surface_flush(surface);
+
+      unsigned char *data = cairo_image_surface_get_data(surface);
+      int stride = cairo_image_surface_get_stride(surface);
+      for (int r = 0; r < h; r++) {
+        uint32_t *pixels = (uint32_t *)(data + r * stride);
+        unsigned char *out = rows + r * row_size + 1 + (size_t)x * 3;
+        for (int i = 0; i < w; i++) {
+          out[i * 3] = pixels[i] >> 16;
+          out[i * 3 + 1] = pixels[i] >> 8;
+          out[i * 3 + 2] = pixels[i];
+        }
+      }
+    }
+
+    for (int r = 0; r < h; r++) {
+      rows[r * row_size] = 0;
+    }
+    write_png_rows(&png, rows, row_size * h, false);
+  }
+
+  end_png(&png);
+  cairo_surface_destroy(surface);
+  free(rows);
+}
+
+cairo_status_t write_stream(void *closure, const unsigned char *data,
+                            unsigned int length) {
+  FILE *file = (FILE *)closure;
+  if (fwrite(data, 1, length, file) != length) {
+    return CAIRO_STATUS_WRITE_ERROR;
+  }
+  return CAIRO_STATUS_SUCCESS;
+}
+
+// Puts each tile that has something on it on its own page.
+void export_pdf(FILE *file, Node *root, int width, int height) {
+  cairo_surface_t *surface = cairo_pdf_surface_create_for_stream(
+      write_stream, file, EXPORT_PAGE_WIDTH, EXPORT_PAGE_HEIGHT);
+
+  for (int y = 0; y < height; y += EXPORT_PAGE_HEIGHT) {
+    for (int x = 0; x < width; x += EXPORT_PAGE_WIDTH) {
+      Rectangle view = {x, y, x + EXPORT_PAGE_WIDTH, y + EXPORT_PAGE_HEIGHT};
+      if (!region_has_nodes(root, view)) {
+        continue;
+      }
+
+      cairo_t *cr = cairo_create(surface);
+      draw_region(cr, root, view);
+      cairo_show_page(cr);
+      cairo_destroy(cr);
+    }
+  }
+
+  cairo_surface_finish(surface);
+  cairo_surface_destroy(surface);
+}
+
+void export_svg(FILE *file, Node *root, int width, int height) {
+  cairo_surface_t *surface =
+      cairo_svg_surface_create_for_stream(write_stream, file, width, height);
+
+  cairo_t *cr = cairo_create(surface);
+  draw_region(cr, root, (Rectangle){0, 0, width, height});
+  cairo_destroy(cr);
+
+  cairo_surface_finish(surface);
+  cairo_surface_destroy(surface);
+}
+
+/*
+ * Lays out the whole tree and renders it to path as PNG, PDF or SVG, picked
+ * by the extension. Node positions are left in export coordinates, so the
+ * window has to lay out again afterwards.
+ */
+bool export_tree(Tree *tree, char *path) {
+  char *extension = strrchr(path, '.');
+  if (extension == NULL || (strcmp(extension, ".png") != 0 &&
+                            strcmp(extension, ".pdf") != 0 &&
+                            strcmp(extension, ".svg") != 0)) {
+    printf("Unknown export format: %s\n", path);
+    return false;
+  }
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    printf("Could not open file %s\n", path);
+    return false;
+  }
+
+  set_style();
+  layout_tree(tree->root, EXPORT_MARGIN, EXPORT_MARGIN);
+
+  double x2 = 0;
+  double y2 = 0;
+  subtree_extent(tree->root, &x2, &y2);
+  int width = ceil(x2) + EXPORT_MARGIN;
+  int height = ceil(y2) + EXPORT_MARGIN;
+
+  if (strcmp(extension, ".png") == 0) {
+    export_png(file, tree->root, width, height);
+  } else if (strcmp(extension, ".pdf") == 0) {
+    export_pdf(file, tree->root, width, height);
+  } else {
+    export_svg(file, tree->root, width, height);
+  }
+
+  fclose(file);
+  return true;
+}
+
+static gboolean handle_return(GtkWidget *widget, GdkEventKey *event,
+                              gpointer data) {
+  (void)widget;
+
+  if (event->keyval == GDK_KEY_Return) {
+    gtk_dialog_response(GTK_DIALOG(data), 1);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+char *ask_for_name() {
+  GtkWidget *dialog =
+      gtk_dialog_new_with_buttons("Enter name", NULL, 0, "_OK", 1, NULL);
+  GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+  GtkWidget *entry = gtk_entry_new();
   gtk_container_add(GTK_CONTAINER(content_area), entry);
   gtk_widget_show_all(dialog);
 
@@ -537,28 +3960,6 @@ bool ask_yes_no(char *question) {
   return response == 1;
 }
 
-int get_unused_id(Node *node) {
-  int id = 0;
-  while (find_node(node, id) != NULL) {
-    id++;
-  }
-  return id;
-}
-
-bool check_if_descendent(Node *root, Node *node) {
-  if (root == node) {
-    return true;
-  }
-
-  for (int i = 0; i < root->n_children; i++) {
-    if (check_if_descendent(root->children[i], node)) {
-      return true;
-    }
-  }
-
-  return false;
-}
-
 char *check_match(char *name, char *pattern) {
   size_t i = 0;
   for (size_t j = 0; j < strlen(name); j++) {
@@ -600,6 +4001,16 @@ void populate_matches(Node *node, char *name, GtkWidget *matches) {
   }
 }
 
+void mark_matches(Node *node, char *name) {
+  if (check_match(node->name, name) != NULL) {
+    mark_node(node);
+  }
+
+  for (int i = 0; i < node->n_children; i++) {
+    mark_matches(node->children[i], name);
+  }
+}
+
 static gboolean search_event_callback(GtkWidget *widget, GdkEventKey *event,
                                       gpointer data) {
   (void)widget;
@@ -616,8 +4027,10 @@ static gboolean search_event_callback(GtkWidget *widget, GdkEventKey *event,
   }
   g_list_free(children);
 
-  populate_matches(draw_root, strdup(value), matches);
+  TRACE_BEGIN(start);
+  populate_matches(view->draw_root, strdup(value), matches);
   gtk_widget_show_all(matches);
+  TRACE_END(start, "populate_matches", NULL);
 
   if (event->keyval == GDK_KEY_Return) {
     gtk_dialog_response(dialog, 1);
@@ -627,9 +4040,9 @@ static gboolean search_event_callback(GtkWidget *widget, GdkEventKey *event,
   return FALSE;
 }
 
-Node *node_search_dialog() {
-  GtkWidget *dialog =
-      gtk_dialog_new_with_buttons("Search", NULL, 0, "_OK", 1, NULL);
+Node *node_search_dialog(Tree *tree) {
+  GtkWidget *dialog = gtk_dialog_new_with_buttons("Search", NULL, 0, "_OK", 1,
+                                                  "_Mark all", 2, NULL);
   GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
   GtkWidget *matched_nodes = gtk_label_new("Matched nodes:");
   GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
@@ -654,14 +4067,25 @@ Node *node_search_dialog() {
 
   const char *name;
   int response = gtk_dialog_run(GTK_DIALOG(dialog));
-  if (response == 1) {
+  if (response == 1 || response == 2) {
     name = gtk_entry_get_text(GTK_ENTRY(entry));
   } else {
     name = NULL;
   }
 
+  if (response == 2) {
+    mark_matches(view->draw_root, (char *)name);
+    gtk_widget_destroy(dialog);
+    return NULL;
+  }
+
   if (name != NULL) {
-    Node *n = fuzzy_search(draw_root, strdup(name));
+    TRACE_BEGIN(start);
+    Node *n = fuzzy_search(view->draw_root, strdup(name));
+    TRACE_END(start, "fuzzy_search", NULL);
+    if (n == NULL && map_index != NULL) {
+      n = map_search(tree, (char *)name);
+    }
     gtk_widget_destroy(dialog);
     return n;
   }
@@ -671,11 +4095,577 @@ Node *node_search_dialog() {
   return NULL;
 }
 
-void calculate_parents(Node *node) {
+typedef struct Reload {
+  Tree *tree;
+  Tree *source;
+  int hash;
+  NodeList changed; // The nodes of source that differ from reload_base.
+} Reload;
+
+void start_reload(Tree *tree);
+
+gboolean apply_reload(gpointer data) {
+  Reload *reload = (Reload *)data;
+  Tree *tree = reload->tree;
+
+  g_rec_mutex_lock(&tree_lock);
+  if (reload->source != NULL && reload->hash != current_hash) {
+    bool clean = edit_version == saved_version;
+    if (clean ||
+        ask_yes_no("The file changed on disk. Discard local changes?")) {
+      // The list only holds what changed since reload_base, which is what
+      // the tree holds unless it was edited or saved since.
+      if (!clean || reload_base_hash != current_hash) {
+        reload->changed.len = 0;
+        diff_trees(NULL, reload->source, &reload->changed);
+      }
+      patch_tree(tree, reload->source, &reload->changed);
+      current_hash = reload->hash;
+      saved_version = edit_version;
+      layout_dirty = true;
+      schedule_frame();
+    }
+  }
+  g_rec_mutex_unlock(&tree_lock);
+
+  if (reload->source != NULL) {
+    if (reload_base != NULL) {
+      free_tree(reload_base);
+    }
+    reload_base = reload->source;
+    reload_base_hash = reload->hash;
+  }
+  free(reload->changed.nodes);
+  free(reload);
+
+  reloading = false;
+  if (reload_queued) {
+    reload_queued = false;
+    start_reload(tree);
+  }
+  return FALSE;
+}
+
+/*
+ * Parses the file into a separate tree and lists what changed since the last
+ * reload, so the window stays responsive and patching touches only that.
+ * reload_base is only replaced in apply_reload, after this thread is done.
+ */
+gpointer reload_thread(gpointer data) {
+  Reload *reload = (Reload *)data;
+
+  FILE *file = fopen(filename, "r");
+  if (file != NULL) {
+    fclose(file);
+    reload->source = create_tree();
+    reload->source->detached = true;
+    if (load_stream(reload->source, filename, false, NULL)) {
+      char *s = serialize_tree(reload->source->root);
+      reload->hash = hash_string(s);
+      free(s);
+      diff_trees(reload_base, reload->source, &reload->changed);
+    } else {
+      free_tree(reload->source);
+      reload->source = NULL;
+    }
+  }
+
+  g_idle_add(apply_reload, reload);
+  return NULL;
+}
+
+void start_reload(Tree *tree) {
+  if (reloading) {
+    reload_queued = true;
+    return;
+  }
+
+  reloading = true;
+  Reload *reload = calloc(1, sizeof(Reload));
+  reload->tree = tree;
+  g_thread_unref(g_thread_new("reload", reload_thread, reload));
+}
+
+void handle_file_changed(GFileMonitor *monitor, GFile *file, GFile *other,
+                         GFileMonitorEvent event, gpointer data) {
+  (void)monitor;
+  (void)file;
+  (void)other;
+
+  if (event == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT && !loading) {
+    start_reload((Tree *)data);
+  }
+}
+
+void watch_file(Tree *tree) {
+  GFile *file = g_file_new_for_path(filename);
+  file_monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, NULL);
+  g_object_unref(file);
+
+  if (file_monitor != NULL) {
+    SIGNAL_CONNECT(file_monitor, "changed", handle_file_changed, tree);
+  }
+}
+
+/*
+ * Edits sent over the control socket. A client writes one command per line
+ * and ends each batch with an empty line or by closing the connection:
+ *
+ *   add PARENT ID NAME     rename ID NAME     color ID COLOR
+ *   move ID PARENT [INDEX] delete ID          select ID         save
+ *
+ * A batch is applied under the tree lock as one transaction. If a command
+ * fails, the ones before it are undone and the reply is "error LINE: WHY",
+ * otherwise it is "ok COUNT". Either way the window lays out once.
+ */
+typedef enum CommandType {
+  COMMAND_ADD,
+  COMMAND_RENAME,
+  COMMAND_COLOR,
+  COMMAND_MOVE,
+  COMMAND_DELETE,
+  COMMAND_SELECT,
+  COMMAND_SAVE,
+} CommandType;
+
+typedef struct Command {
+  CommandType type;
+  int id;
+  int target;
+  int value;
+  char *text;
+} Command;
+
+// What is needed to take back one applied command.
+typedef struct Undo {
+  CommandType type;
+  Node *node;
+  Node *parent; // The old parent, or the old selection for select.
+  int index;
+  int value;
+  char *text;
+  Node *shards[2]; // The shards marked modified, NULL for the main file.
+  bool shard_dirty[2];
+  int n_shards;
+} Undo;
+
+typedef struct ControlClient {
+  Tree *tree;
+  int fd;
+} ControlClient;
+
+char *control_path = NULL;
+
+// Fills command from line, which it points into. Returns an error or NULL.
+const char *parse_command(char *line, Command *command) {
+  char verb[16];
+  int n = 0;
+  if (sscanf(line, "%15s %n", verb, &n) != 1) {
+    return "empty command";
+  }
+  char *rest = line + n;
+
+  *command = (Command){COMMAND_SAVE, -1, -1, -1, NULL};
+  int text = 0;
+  if (strcmp(verb, "add") == 0) {
+    command->type = COMMAND_ADD;
+    if (sscanf(rest, "%d %d %n", &command->target, &command->id, &text) < 2) {
+      return "usage: add PARENT ID NAME";
+    }
+  } else if (strcmp(verb, "rename") == 0) {
+    command->type = COMMAND_RENAME;
+    if (sscanf(rest, "%d %n", &command->id, &text) < 1) {
+      return "usage: rename ID NAME";
+    }
+  } else if (strcmp(verb, "color") == 0) {
+    command->type = COMMAND_COLOR;
+    if (sscanf(rest, "%d %d", &command->id, &command->value) != 2 ||
+        command->value < 0 || command->value > 3) {
+      return "usage: color ID COLOR, with COLOR from 0 to 3";
+    }
+  } else if (strcmp(verb, "move") == 0) {
+    command->type = COMMAND_MOVE;
+    int given = sscanf(rest, "%d %d %d", &command->id, &command->target,
+                       &command->value);
+    if (given < 2) {
+      return "usage: move ID PARENT [INDEX]";
+    }
+    // Without INDEX, value stays -1 and the node goes last.
+    if (given == 3 && command->value < 0) {
+      return "index out of range";
+    }
+  } else if (strcmp(verb, "delete") == 0) {
+    command->type = COMMAND_DELETE;
+    if (sscanf(rest, "%d", &command->id) != 1) {
+      return "usage: delete ID";
+    }
+  } else if (strcmp(verb, "select") == 0) {
+    command->type = COMMAND_SELECT;
+    if (sscanf(rest, "%d", &command->id) != 1) {
+      return "usage: select ID";
+    }
+  } else if (strcmp(verb, "save") != 0) {
+    return "unknown command";
+  }
+
+  if (command->type == COMMAND_ADD || command->type == COMMAND_RENAME) {
+    command->text = rest + text;
+    if (command->text[0] == '\0') {
+      return "missing name";
+    }
+  }
+  return NULL;
+}
+
+// Returns the node with id if it is still part of the tree.
+Node *attached_node(Tree *tree, int id) {
+  Node *node = find_node(tree, id);
+  Node *top = node;
+  while (top != NULL && top->parent != NULL) {
+    top = top->parent;
+  }
+  return top == tree->root ? node : NULL;
+}
+
+// Marks the shard of node modified, keeping in undo whether it already was.
+void touch_shard_undoable(Undo *undo, Node *node) {
+  Node *shard = node;
+  while (shard != NULL && shard->mount == NULL) {
+    shard = shard->parent;
+  }
+  undo->shards[undo->n_shards] = shard;
+  undo->shard_dirty[undo->n_shards++] = shard != NULL && shard->mount_dirty;
+  touch_shard(node);
+}
+
+/*
+ * Takes the ids of a subtree out of the index, or puts them back. A node
+ * deleted in a batch is kept until the batch commits, but its id is free for
+ * the commands after it.
+ */
+void index_subtree(Tree *tree, Node *node, bool indexed) {
+  if (indexed) {
+    register_node(tree, node);
+  } else if (find_node(tree, node->id) == node) {
+    g_hash_table_remove(tree->nodes, GINT_TO_POINTER(node->id));
+  }
   for (int i = 0; i < node->n_children; i++) {
-    node->children[i]->parent = node;
-    calculate_parents(node->children[i]);
+    index_subtree(tree, node->children[i], indexed);
+  }
+}
+
+// Adds child to parent at index, moving the children after it back.
+void add_child_at(Node *parent, Node *child, int index) {
+  add_child(parent, child);
+  for (int i = parent->n_children - 1; i > index; i--) {
+    parent->children[i] = parent->children[i - 1];
+    parent->children[i]->index = i;
+  }
+  parent->children[index] = child;
+  child->index = index;
+}
+
+const char *apply_command(Tree *tree, Command *command, Undo *undo) {
+  *undo = (Undo){command->type, NULL, NULL, 0, 0, NULL, {NULL, NULL},
+                 {false, false}, 0};
+  if (command->type == COMMAND_SAVE) {
+    return NULL;
+  }
+
+  Node *node = NULL;
+  if (command->type != COMMAND_ADD) {
+    node = attached_node(tree, command->id);
+    if (node == NULL) {
+      return "no such node";
+    }
+  }
+  Node *parent = NULL;
+  if (command->type == COMMAND_ADD || command->type == COMMAND_MOVE) {
+    parent = attached_node(tree, command->target);
+    if (parent == NULL) {
+      return "no such parent";
+    }
+    load_mount(tree, parent);
+  }
+
+  switch (command->type) {
+  case COMMAND_ADD:
+    if (command->id < 0 || find_node(tree, command->id) != NULL) {
+      return "id in use";
+    }
+    node = create_node(command->id, intern(command->text));
+    add_child(parent, node);
+    register_node(tree, node);
+    touch_shard_undoable(undo, parent);
+    break;
+  case COMMAND_RENAME:
+    undo->text = node->name;
+    node->name = intern(command->text);
+    node->text_font_size = 0;
+    invalidate_size(node);
+    touch_shard_undoable(undo, node->parent);
+    break;
+  case COMMAND_COLOR:
+    undo->value = node->color;
+    node->color = command->value;
+    touch_shard_undoable(undo, node->parent);
+    break;
+  case COMMAND_MOVE: {
+    if (node->parent == NULL || check_if_descendent(node, parent)) {
+      return "cannot move a node into its own subtree";
+    }
+    int last = parent->n_children - (node->parent == parent ? 1 : 0);
+    int index = command->value < 0 ? last : command->value;
+    if (index > last) {
+      return "index out of range";
+    }
+    undo->parent = node->parent;
+    undo->index = child_index(node);
+    touch_shard_undoable(undo, node->parent);
+    remove_child(node->parent, node);
+    add_child_at(parent, node, index);
+    touch_shard_undoable(undo, parent);
+    break;
+  }
+  case COMMAND_DELETE:
+    if (node->parent == NULL) {
+      return "cannot delete the root";
+    }
+    undo->parent = node->parent;
+    undo->index = child_index(node);
+    remove_child(node->parent, node);
+    index_subtree(tree, node, false);
+    touch_shard_undoable(undo, undo->parent);
+    break;
+  case COMMAND_SELECT:
+    undo->parent = selected_node;
+    select_node(node);
+    break;
+  case COMMAND_SAVE:
+    break;
+  }
+
+  undo->node = node;
+  return NULL;
+}
+
+void revert_command(Tree *tree, Undo *undo) {
+  Node *node = undo->node;
+  switch (undo->type) {
+  case COMMAND_ADD:
+    remove_child(node->parent, node);
+    free_subtree(tree, node);
+    break;
+  case COMMAND_RENAME:
+    release(node->name);
+    node->name = undo->text;
+    node->text_font_size = 0;
+    invalidate_size(node);
+    break;
+  case COMMAND_COLOR:
+    node->color = undo->value;
+    break;
+  case COMMAND_MOVE:
+    remove_child(node->parent, node);
+    add_child_at(undo->parent, node, undo->index);
+    break;
+  case COMMAND_DELETE:
+    add_child_at(undo->parent, node, undo->index);
+    index_subtree(tree, node, true);
+    break;
+  case COMMAND_SELECT:
+    select_node(undo->parent);
+    break;
+  case COMMAND_SAVE:
+    break;
+  }
+
+  for (int i = undo->n_shards - 1; i >= 0; i--) {
+    if (undo->shards[i] != NULL) {
+      undo->shards[i]->mount_dirty = undo->shard_dirty[i];
+    }
+  }
+}
+
+// Drops what the undo entry kept alive once its batch has gone through.
+void commit_command(Tree *tree, Undo *undo) {
+  if (undo->type == COMMAND_RENAME) {
+    release(undo->text);
+  } else if (undo->type == COMMAND_DELETE) {
+    discard_subtree(tree, undo->node);
+  }
+}
+
+/*
+ * Applies the n commands in lines to the tree and writes the reply. The tree
+ * is saved at most once, after the whole batch, however many saves it has.
+ */
+void run_batch(Tree *tree, char **lines, int n, char *reply) {
+  Command *commands = malloc(n * sizeof(Command));
+  Undo *undo = malloc(n * sizeof(Undo));
+  const char *error = NULL;
+  int failed = 0;
+  for (; failed < n && error == NULL; failed++) {
+    error = parse_command(lines[failed], &commands[failed]);
+  }
+
+  g_rec_mutex_lock(&tree_lock);
+  if (error == NULL && (loading || read_only)) {
+    error = "tree is not editable";
+    failed = 0;
+  }
+
+  int applied = 0;
+  int edits = edit_version;
+  bool save = false;
+  if (error == NULL) {
+    for (; applied < n; applied++) {
+      error = apply_command(tree, &commands[applied], &undo[applied]);
+      if (error != NULL) {
+        failed = applied + 1;
+        break;
+      }
+      save = save || commands[applied].type == COMMAND_SAVE;
+    }
+  }
+
+  if (error != NULL) {
+    for (int i = applied - 1; i >= 0; i--) {
+      revert_command(tree, &undo[i]);
+    }
+    edit_version = edits;
+  } else {
+    for (int i = 0; i < applied; i++) {
+      commit_command(tree, &undo[i]);
+    }
+    if (save) {
+      save_tree(tree);
+    }
+  }
+  g_rec_mutex_unlock(&tree_lock);
+
+  if (applied > 0) {
+    request_redraw();
+  }
+
+  if (error != NULL) {
+    sprintf(reply, "error %d: %s\n", failed, error);
+  } else {
+    sprintf(reply, "ok %d\n", n);
+  }
+  free(commands);
+  free(undo);
+}
+
+// Reads batches from one client until it disconnects.
+gpointer serve_control(gpointer data) {
+  ControlClient *client = (ControlClient *)data;
+  FILE *in = fdopen(client->fd, "r");
+  if (in == NULL) {
+    close(client->fd);
+    free(client);
+    return NULL;
+  }
+
+  char **batch = NULL;
+  int n_batch = 0;
+  int size_batch = 0;
+  char *line = NULL;
+  size_t size = 0;
+  bool done = false;
+  while (!done) {
+    ssize_t len = getline(&line, &size, in);
+    done = len < 0;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+
+    if (len > 0) {
+      if (n_batch == size_batch) {
+        size_batch = size_batch == 0 ? 64 : size_batch * 2;
+        batch = realloc(batch, size_batch * sizeof(char *));
+      }
+      batch[n_batch++] = strdup(line);
+    } else if (n_batch > 0) {
+      char reply[100];
+      run_batch(client->tree, batch, n_batch, reply);
+      send(client->fd, reply, strlen(reply), MSG_NOSIGNAL);
+      for (int i = 0; i < n_batch; i++) {
+        free(batch[i]);
+      }
+      n_batch = 0;
+    }
+  }
+
+  free(line);
+  free(batch);
+  fclose(in);
+  free(client);
+  return NULL;
+}
+
+gpointer accept_control(gpointer data) {
+  ControlClient *server = (ControlClient *)data;
+  while (true) {
+    int fd = accept(server->fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      printf("Control socket stopped: %s\n", strerror(errno));
+      return NULL;
+    }
+
+    ControlClient *client = malloc(sizeof(ControlClient));
+    *client = (ControlClient){server->tree, fd};
+    g_thread_unref(g_thread_new("control", serve_control, client));
+  }
+}
+
+void remove_control_socket() {
+  unlink(control_path);
+}
+
+/*
+ * Listens for clients on the UNIX socket at path, replacing a stale socket
+ * left by an earlier run. Only the user running the editor may connect.
+ */
+bool open_control_socket(Tree *tree, char *path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printf("Socket path too long: %s\n", path);
+    return false;
+  }
+  strcpy(address.sun_path, path);
+
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      printf("Not a socket: %s\n", path);
+      return false;
+    }
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  mode_t mask = umask(0077);
+  bool bound =
+      fd >= 0 && bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+  umask(mask);
+  if (!bound || listen(fd, 16) != 0) {
+    printf("Could not listen on %s: %s\n", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
   }
+  control_path = path;
+  atexit(remove_control_socket);
+
+  ControlClient *server = malloc(sizeof(ControlClient));
+  *server = (ControlClient){tree, fd};
+  g_thread_unref(g_thread_new("control", accept_control, server));
+  return true;
 }
 
 bool is_visible(Rectangle rect, double x_offset, double y_offset, double width,
@@ -690,50 +4680,185 @@ bool is_visible(Rectangle rect, double x_offset, double y_offset, double width,
 }
 
 void quit(Tree *tree) {
-  char *s = serialize_tree(tree->root);
-  if (current_hash != hash_string(s)) {
+  if (loading || read_only) {
+    gtk_main_quit();
+    return;
+  }
+
+  if (tree_modified(tree)) {
     if (ask_yes_no("Tree has been modified. Really quit?")) {
       gtk_main_quit();
     }
   } else {
     gtk_main_quit();
   }
-  free(s);
 }
 
-void center_node(Node *selected) {
+/*
+ * Eases the view towards the target offsets once per frame of the GDK frame
+ * clock, and draws the frame. The callback removes itself once the view has
+ * arrived, so an idle window does no work.
+ */
+gboolean handle_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer data) {
+  View *v = (View *)data;
+
+  gint64 now = gdk_frame_clock_get_frame_time(clock);
+  double elapsed = v->last_frame_time == 0 ? 0 : now - v->last_frame_time;
+  v->last_frame_time = now;
+
+  double step = 1 - exp(-elapsed / PAN_TIME);
+  v->x_offset += (v->target_x_offset - v->x_offset) * step;
+  v->y_offset += (v->target_y_offset - v->y_offset) * step;
+  gtk_widget_queue_draw(widget);
+
+  if (fabs(v->target_x_offset - v->x_offset) < 0.5 &&
+      fabs(v->target_y_offset - v->y_offset) < 0.5) {
+    v->x_offset = v->target_x_offset;
+    v->y_offset = v->target_y_offset;
+    v->frame_tick = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * Input handlers only change state and call this, so any number of events
+ * between two frames costs a single redraw.
+ */
+void schedule_view(View *v) {
+  if (v->frame_tick == 0) {
+    v->last_frame_time = 0;
+    v->frame_tick =
+        gtk_widget_add_tick_callback(v->drawing_area, handle_tick, v, NULL);
+  }
+}
+
+// Redraws every view, as after a change to the tree they all share.
+void schedule_frame() {
+  for (guint i = 0; views != NULL && i < views->len; i++) {
+    schedule_view(g_ptr_array_index(views, i));
+  }
+}
+
+// Moves the view at once, without animating, as when dragging it.
+void pan_view(double dx, double dy) {
+  view->x_offset += dx;
+  view->y_offset += dy;
+  view->target_x_offset += dx;
+  view->target_y_offset += dy;
+}
+
+gboolean redraw_idle(gpointer data) {
+  (void)data;
+
+  g_atomic_int_set(&redraw_pending, 0);
+  layout_dirty = true;
+  schedule_frame();
+  return FALSE;
+}
+
+// Safe to call from any thread; bursts collapse into one redraw.
+void request_redraw() {
+  if (g_atomic_int_compare_and_exchange(&redraw_pending, 0, 1)) {
+    g_idle_add(redraw_idle, NULL);
+  }
+}
+
+void view_size(View *v, int *width, int *height) {
+  gtk_window_get_size(GTK_WINDOW(gtk_widget_get_toplevel(v->drawing_area)),
+                      width, height);
+}
+
+// Whether node will be on screen once v has finished panning.
+bool view_shows(View *v, Node *node) {
   int width;
   int height;
-  gtk_window_get_size(GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)), &width,
-                      &height);
+  view_size(v, &width, &height);
+  return is_visible(to_view(v, node->rect), v->target_x_offset,
+                    v->target_y_offset, width, height);
+}
 
-  y_offset = -selected->rect.y1 + 100;
-  x_offset = -selected->rect.x1 + 100;
+void center_node(Node *selected) {
+  Rectangle rect = to_view(view, selected->rect);
+  view->target_y_offset = -rect.y1 + 100;
+  view->target_x_offset = -rect.x1 + 100;
 }
 
-Node *get_nth_node(Node *node, int *n) {
-  if (*n == 0) {
-    return node;
+// Scales the view by factor about the middle of its window.
+void zoom_view(double factor) {
+  double zoom = fmin(fmax(view->zoom * factor, 0.05), 20);
+  factor = zoom / view->zoom;
+  view->zoom = zoom;
+
+  int width;
+  int height;
+  view_size(view, &width, &height);
+  double dx = (width / 2.0 - view->target_x_offset) * (1 - factor);
+  double dy = (height / 2.0 - view->target_y_offset) * (1 - factor);
+  view->target_x_offset += dx;
+  view->target_y_offset += dy;
+  view->x_offset = view->target_x_offset;
+  view->y_offset = view->target_y_offset;
+}
+
+/*
+ * Brings the running totals of the subtree sizes of the children of node up
+ * to date: offsets[i] counts the nodes in children 0 to i. Edits mark them
+ * dirty wherever a count or the order of the children changes.
+ */
+void update_offsets(Node *node) {
+  if (!node->offsets_dirty) {
+    return;
   }
 
-  *n = *n - 1;
+  if (node->offsets_size < node->n_children + 1) {
+    int size = node->n_children + 1;
+    g_atomic_pointer_add(&offset_bytes,
+                         (gssize)(size - node->offsets_size) * sizeof(int));
+    node->offsets = realloc(node->offsets, size * sizeof(int));
+    if (node->offsets == NULL) {
+      printf("Could not allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+    node->offsets_size = size;
+  }
+  int total = 0;
   for (int i = 0; i < node->n_children; i++) {
-    Node *found = get_nth_node(node->children[i], n);
-    if (found != NULL) {
-      return found;
+    total += node->children[i]->n_descendents + 1;
+    node->offsets[i] = total;
+  }
+  node->offsets_dirty = false;
+}
+
+/*
+ * Returns the nth node of the subtree in preorder. Each level binary searches
+ * the running totals of the children, which are only rebuilt along the paths
+ * that were edited, so a lookup does not scan any child list.
+ */
+Node *get_nth_node(Node *node, int n) {
+  while (n > 0) {
+    n--;
+    update_offsets(node);
+    int low = 0;
+    int high = node->n_children - 1;
+    while (low < high) {
+      int mid = (low + high) / 2;
+      if (node->offsets[mid] > n) {
+        high = mid;
+      } else {
+        low = mid + 1;
+      }
     }
+    if (low > 0) {
+      n -= node->offsets[low - 1];
+    }
+    node = node->children[low];
   }
 
-  return NULL;
+  return node;
 }
 
-int count_descendents(Node *node) {
-  int count = 0;
-  for (int i = 0; i < node->n_children; i++) {
-    count += count_descendents(node->children[i]);
-  }
-  return count + node->n_children;
-}
+int count_descendents(Node *node) { return node->n_descendents; }
 
 void show_help() {
   GtkWidget *dialog =
@@ -743,25 +4868,42 @@ void show_help() {
                                    "j: Move down\n"
                                    "k: Move up\n"
                                    "l: Move right\n"
-                                   "H: Shift left\n"
-                                   "K: Shift up\n"
-                                   "J: Shift down\n"
+                                   "H: Shift left (marked nodes if any)\n"
+                                   "K: Shift up (marked nodes if any)\n"
+                                   "J: Shift down (marked nodes if any)\n"
                                    "e: Edit content\n"
                                    "n: Add child\n"
                                    "r: Rename\n"
-                                   "d: Delete\n"
+                                   "d: Delete (marked nodes if any)\n"
                                    "i: Insert\n"
-                                   "c: Change color\n"
+                                   "c: Change color (and of marked nodes)\n"
+                                   "v: Mark subtree\n"
+                                   "V: Clear marks\n"
+                                   "Shift-click: Mark node\n"
+                                   "Shift-drag: Mark region\n"
                                    "C: Change color scheme\n"
                                    "z: Center\n"
+                                   "u: Unload shard\n"
+                                   "x: Move subtree to shard file\n"
                                    "s: Save\n"
                                    "S: Print\n"
+                                   "E: Export image\n"
+#ifdef TRACE
+                                   "T: Write trace to " TRACE_FILE "\n"
+#endif
                                    "m: Toggle slim mode\n"
+                                   "M: Toggle minimap\n"
+                                   "o: Cycle layout style\n"
+                                   "W: Open another view\n"
+                                   "+: Zoom in\n"
+                                   "-: Zoom out\n"
                                    "a: About\n"
                                    "q: Quit\n"
                                    "?: Help\n"
                                    "/: Search\n"
                                    "0: Select root\n"
+                                   "]: Next node\n"
+                                   "[: Previous node\n"
                                    "Semicolon: Show/hide side panel\n"
                                    "Up: Pan up\n"
                                    "Down: Pan down\n"
@@ -797,16 +4939,328 @@ void show_about() {
   gtk_widget_destroy(dialog);
 }
 
+/*
+ * Only the labels spanning the swapped siblings change, so when the labels
+ * are current that span is relabelled and they stay current.
+ */
 void swap_nodes(Node *parent, int i, int j) {
+  int low = i < j ? i : j;
+  int high = i < j ? j : i;
+  bool labelled = has_preorder_label(parent->children[low]);
+  int next = parent->children[low]->preorder;
+
   Node *temp = parent->children[i];
   parent->children[i] = parent->children[j];
   parent->children[j] = temp;
+  parent->children[i]->index = i;
+  parent->children[j]->index = j;
+  parent->offsets_dirty = true;
+  structure_version++;
+
+  if (labelled) {
+    for (int k = low; k <= high; k++) {
+      next = place_preorder(parent->children[k], next);
+    }
+    preorder_version = structure_version;
+  }
 }
 
-static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
+Node *insert_child(Tree *tree, Node *parent, char *name) {
+  load_mount(tree, parent);
+  Node *node = create_node(get_unused_id(tree), intern(name));
+  add_child(parent, node);
+  register_node(tree, node);
+  touch_shard(parent);
+  return node;
+}
+
+// Puts a new node in the place of node and makes node its only child.
+// Puts a new node in the place of node and node below it. The root has no
+// place to take, so it is refused with NULL.
+Node *insert_parent(Tree *tree, Node *node, char *name) {
+  Node *parent = node->parent;
+  if (parent == NULL) {
+    return NULL;
+  }
+
+  int index = child_index(node);
+  Node *new_node = create_node(get_unused_id(tree), intern(name));
+  add_child(new_node, node);
+  register_node(tree, new_node);
+
+  parent->children[index] = new_node;
+  new_node->parent = parent;
+  new_node->index = index;
+  structure_version++;
+  invalidate_size(parent);
+  adjust_descendents(parent, 1);
+  touch_shard(parent);
+  return new_node;
+}
+
+void delete_node(Tree *tree, Node *node) {
+  Node *parent = node->parent;
+  remove_child(parent, node);
+  touch_shard(parent);
+  discard_subtree(tree, node);
+}
+
+// Makes node the last child of its grandparent.
+bool reparent_up(Node *node) {
+  Node *parent = node->parent;
+  if (parent == NULL || parent->parent == NULL) {
+    return false;
+  }
+
+  Node *grandparent = parent->parent;
+  bool labelled = has_preorder_label(grandparent);
+  remove_child(parent, node);
+  add_child(grandparent, node);
+  touch_shard(parent);
+  touch_shard(grandparent);
+
+  // The subtree of grandparent keeps its size, so only it needs new labels.
+  if (labelled) {
+    place_preorder(grandparent, grandparent->preorder);
+    preorder_version = structure_version;
+  }
+  return true;
+}
+
+// Swaps node with the sibling delta places away, if there is one.
+bool move_sibling(Node *node, int delta) {
+  Node *parent = node->parent;
+  if (parent == NULL) {
+    return false;
+  }
+
+  int i = child_index(node);
+  if (i + delta < 0 || i + delta >= parent->n_children) {
+    return false;
+  }
+
+  swap_nodes(parent, i, i + delta);
+  touch_shard(parent);
+  return true;
+}
+
+// Lists the parents of nodes, each once.
+NodeList unique_parents(NodeList *nodes) {
+  NodeList parents = {NULL, 0, 0};
+  GHashTable *seen = g_hash_table_new(NULL, NULL);
+  for (int i = 0; i < nodes->len; i++) {
+    Node *parent = nodes->nodes[i]->parent;
+    if (parent != NULL && g_hash_table_add(seen, parent)) {
+      append_node(&parents, parent);
+    }
+  }
+  g_hash_table_destroy(seen);
+  return parents;
+}
+
+// Takes all marked children out of parent in a single pass.
+void remove_marked_children(Node *parent, NodeList *removed) {
+  int kept = 0;
+  int lost = 0;
+  for (int i = 0; i < parent->n_children; i++) {
+    Node *child = parent->children[i];
+    if (is_marked(child)) {
+      lost += child->n_descendents + 1;
+      child->parent = NULL;
+      append_node(removed, child);
+    } else {
+      child->index = kept;
+      parent->children[kept++] = child;
+    }
+  }
+
+  parent->n_children = kept;
+  parent->stale_from = G_MAXINT;
+  adjust_descendents(parent, -lost);
+  invalidate_size(parent);
+  touch_shard(parent);
+  structure_version++;
+}
+
+/*
+ * The bulk edits below apply to every marked node at once. Each visits the
+ * marked nodes and the child list of each affected parent once, so the cost
+ * does not depend on the size of the rest of the tree.
+ */
+void color_marked(int color) {
+  NodeList nodes = marked_nodes(false);
+  for (int i = 0; i < nodes.len; i++) {
+    nodes.nodes[i]->color = color;
+    touch_shard(nodes.nodes[i]->parent);
+  }
+  free(nodes.nodes);
+}
+
+void delete_marked(Tree *tree) {
+  unmark_node(tree->root);
+  NodeList roots = marked_nodes(true);
+  NodeList parents = unique_parents(&roots);
+  NodeList removed = {NULL, 0, 0};
+  for (int i = 0; i < parents.len; i++) {
+    remove_marked_children(parents.nodes[i], &removed);
+  }
+  for (int i = 0; i < removed.len; i++) {
+    discard_subtree(tree, removed.nodes[i]);
+  }
+  clear_marks();
+
+  if (selected_node == NULL) {
+    select_node(parents.len > 0 ? parents.nodes[0] : tree->root);
+  }
+
+  free(roots.nodes);
+  free(parents.nodes);
+  free(removed.nodes);
+}
+
+/*
+ * Makes each marked node a child of its grandparent, keeping their order.
+ * All nodes are taken out before any is added back, so each moves up one
+ * level of the tree as it was, even when a marked node lands next to another
+ * marked node.
+ */
+void reparent_marked() {
+  NodeList roots = marked_nodes(true);
+  NodeList parents = unique_parents(&roots);
+  NodeList *moved = calloc(parents.len, sizeof(NodeList));
+  Node **grandparents = malloc(parents.len * sizeof(Node *));
+  for (int i = 0; i < parents.len; i++) {
+    grandparents[i] = parents.nodes[i]->parent;
+    if (grandparents[i] != NULL) {
+      remove_marked_children(parents.nodes[i], &moved[i]);
+    }
+  }
+
+  for (int i = 0; i < parents.len; i++) {
+    for (int j = 0; j < moved[i].len; j++) {
+      add_child(grandparents[i], moved[i].nodes[j]);
+    }
+    if (grandparents[i] != NULL) {
+      touch_shard(grandparents[i]);
+    }
+    free(moved[i].nodes);
+  }
+
+  free(moved);
+  free(grandparents);
+  free(roots.nodes);
+  free(parents.nodes);
+}
+
+/*
+ * Moves each marked node one place towards the end of its siblings, or the
+ * start if delta is negative. Runs of marked siblings move together.
+ */
+void move_marked(int delta) {
+  NodeList nodes = marked_nodes(false);
+  NodeList parents = unique_parents(&nodes);
+  for (int i = 0; i < parents.len; i++) {
+    Node *parent = parents.nodes[i];
+    int n = parent->n_children;
+    if (delta < 0) {
+      for (int j = 1; j < n; j++) {
+        if (is_marked(parent->children[j]) &&
+            !is_marked(parent->children[j - 1])) {
+          swap_nodes(parent, j, j - 1);
+        }
+      }
+    } else {
+      for (int j = n - 2; j >= 0; j--) {
+        if (is_marked(parent->children[j]) &&
+            !is_marked(parent->children[j + 1])) {
+          swap_nodes(parent, j, j + 1);
+        }
+      }
+    }
+    touch_shard(parent);
+  }
+
+  free(nodes.nodes);
+  free(parents.nodes);
+}
+
+/*
+ * Edits, saving and the random pick wait until the whole file is linked, and
+ * are not available at all while browsing a file read-only.
+ */
+bool requires_loaded_tree(guint keyval) {
+  switch (keyval) {
+  case GDK_KEY_c:
+  case GDK_KEY_H:
+  case GDK_KEY_J:
+  case GDK_KEY_K:
+  case GDK_KEY_e:
+  case GDK_KEY_n:
+  case GDK_KEY_r:
+  case GDK_KEY_d:
+  case GDK_KEY_i:
+  case GDK_KEY_s:
+  case GDK_KEY_S:
+  case GDK_KEY_E:
+  case GDK_KEY_space:
+  case GDK_KEY_u:
+  case GDK_KEY_x:
+    return true;
+  }
+
+  return false;
+}
+
+View *open_view(Tree *tree, Node *root);
+
+// Keys that pan, zoom or move the selection, which the other views only see
+// through the selection.
+bool view_local_key(guint keyval) {
+  switch (keyval) {
+  case GDK_KEY_Up:
+  case GDK_KEY_Down:
+  case GDK_KEY_Left:
+  case GDK_KEY_Right:
+  case GDK_KEY_plus:
+  case GDK_KEY_equal:
+  case GDK_KEY_minus:
+  case GDK_KEY_z:
+  case GDK_KEY_M:
+  case GDK_KEY_semicolon:
+  case GDK_KEY_h:
+  case GDK_KEY_j:
+  case GDK_KEY_k:
+  case GDK_KEY_l:
+  case GDK_KEY_bracketleft:
+  case GDK_KEY_bracketright:
+  case GDK_KEY_0:
+  case GDK_KEY_space:
+  case GDK_KEY_slash:
+    return true;
+  }
+
+  return keyval >= GDK_KEY_1 && keyval <= GDK_KEY_9;
+}
+
+// Redraws the view if it holds node.
+void schedule_view_of(View *v, Node *node) {
+  if (node != NULL && check_if_descendent(v->draw_root, node)) {
+    schedule_view(v);
+  }
+}
+
+gboolean handle_key_locked(GtkWidget *widget, GdkEventKey *event,
                            gpointer data) {
   (void)widget;
-  Tree *tree = (Tree *)data;
+  view = (View *)data;
+  Tree *tree = view->tree;
+  Node *old_selected = selected_node;
+  Node *old_root = view->draw_root;
+  int old_structure = structure_version;
+
+  if ((loading || read_only) && requires_loaded_tree(event->keyval)) {
+    return FALSE;
+  }
 
   switch (event->keyval) {
   case (GDK_KEY_Escape): {
@@ -834,92 +5288,81 @@ static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
       if (selected->color > 3) {
         selected->color = 0;
       }
+      touch_shard(selected->parent);
+      color_marked(selected->color);
     }
     break;
   }
   case (GDK_KEY_H): {
     Node *selected = get_selected_node(tree->root);
-    if (selected != NULL) {
-      Node *parent = selected->parent;
-      if (parent != NULL) {
-        Node *grandparent = parent->parent;
-        if (grandparent != NULL) {
-          remove_child(parent, selected);
-          add_child(grandparent, selected);
-        }
-      }
+    if (count_marked() > 0) {
+      reparent_marked();
+    } else if (selected != NULL) {
+      reparent_up(selected);
     }
     break;
   }
   case (GDK_KEY_J): {
     Node *selected = get_selected_node(tree->root);
-    if (selected != NULL) {
-      Node *parent = selected->parent;
-      if (parent != NULL) {
-        for (int i = 0; i < parent->n_children - 1; i++) {
-          if (parent->children[i] == selected) {
-            swap_nodes(parent, i, i + 1);
-            break;
-          }
-        }
-      }
+    if (count_marked() > 0) {
+      move_marked(1);
+    } else if (selected != NULL) {
+      move_sibling(selected, 1);
     }
     break;
   }
   case (GDK_KEY_K): {
+    Node *selected = get_selected_node(tree->root);
+    if (count_marked() > 0) {
+      move_marked(-1);
+    } else if (selected != NULL) {
+      move_sibling(selected, -1);
+    }
+    break;
+  }
+  case (GDK_KEY_v): {
     Node *selected = get_selected_node(tree->root);
     if (selected != NULL) {
-      Node *parent = selected->parent;
-      if (parent != NULL) {
-        for (int i = 1; i < parent->n_children; i++) {
-          if (parent->children[i] == selected) {
-            swap_nodes(parent, i, i - 1);
-            break;
-          }
-        }
-      }
+      mark_subtree(selected);
     }
     break;
   }
+  case (GDK_KEY_V): {
+    clear_marks();
+    break;
+  }
   case (GDK_KEY_h): {
     Node *selected = get_selected_node(tree->root);
     if (selected != NULL) {
       if (selected->parent != NULL) {
-        selected->selected = false;
-        selected->parent->selected = true;
+        select_node(selected->parent);
       }
     } else {
-      tree->root->selected = true;
+      select_node(tree->root);
     }
     break;
   }
   case (GDK_KEY_l): {
     Node *selected = get_selected_node(tree->root);
     if (selected != NULL) {
+      expand_node(tree, selected);
       if (selected->n_children > 0) {
-        selected->selected = false;
-        selected->children[0]->selected = true;
+        select_node(selected->children[0]);
       }
     } else {
-      tree->root->selected = true;
+      select_node(tree->root);
     }
     break;
   }
   case (GDK_KEY_j): {
     Node *selected = get_selected_node(tree->root);
     if (selected != NULL) {
-      if (selected->parent != NULL) {
-        for (int i = 0; i < selected->parent->n_children; i++) {
-          if (selected->parent->children[i] == selected) {
-            if (i < selected->parent->n_children - 1) {
-              selected->selected = false;
-              selected->parent->children[i + 1]->selected = true;
-            }
-          }
-        }
+      Node *parent = selected->parent;
+      if (parent != NULL && child_index(selected) < parent->n_children - 1) {
+        select_node(parent->children[selected->index + 1]);
       }
     } else {
-      tree->root->selected = true;
+      select_node(tree->root);
     }
     break;
   }
@@ -929,7 +5372,8 @@ static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
       if (selected->filename == NULL) {
         char filename[100];
         sprintf(filename, "content/%s.txt", selected->name);
-        selected->filename = strdup(filename);
+        assign_string(&selected->filename, filename);
+        touch_shard(selected->parent);
       }
 
       if (selected->filename != NULL) {
@@ -947,18 +5391,12 @@ static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
   case (GDK_KEY_k): {
     Node *selected = get_selected_node(tree->root);
     if (selected != NULL) {
-      if (selected->parent != NULL) {
-        for (int i = 0; i < selected->parent->n_children; i++) {
-          if (selected->parent->children[i] == selected) {
-            if (i > 0) {
-              selected->selected = false;
-              selected->parent->children[i - 1]->selected = true;
-            }
-          }
-        }
+      Node *parent = selected->parent;
+      if (parent != NULL && child_index(selected) > 0) {
+        select_node(parent->children[selected->index - 1]);
       }
     } else {
-      tree->root->selected = true;
+      select_node(tree->root);
     }
     break;
   }
@@ -967,9 +5405,8 @@ static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
     if (selected != NULL) {
       char *name = ask_for_name();
       if (name) {
-        Node *new_node = create_node(get_unused_id(tree->root));
-        new_node->name = strdup(name);
-        add_child(selected, new_node);
+        insert_child(tree, selected, name);
+        free(name);
       }
     }
     break;
@@ -979,14 +5416,23 @@ static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
     if (selected != NULL) {
       char *name = ask_for_name();
       if (name) {
-        selected->name = name;
+        assign_string(&selected->name, name);
+        free(name);
+        selected->text_font_size = 0;
+        invalidate_size(selected);
+        touch_shard(selected->parent);
+        layout_dirty = true;
       }
     }
     break;
   }
   case (GDK_KEY_d): {
     Node *selected = get_selected_node(tree->root);
-    if (selected != NULL) {
+    if (count_marked() > 0) {
+      if (ask_yes_no("Delete all marked nodes?")) {
+        delete_marked(tree);
+      }
+    } else if (selected != NULL) {
       Node *parent = selected->parent;
       if (parent != NULL) {
         if (selected->n_children > 0) {
@@ -994,57 +5440,98 @@ static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
             break;
           }
         }
-        for (int i = 0; i < parent->n_children; i++) {
-          if (parent->children[i] == selected) {
-            for (int j = i; j < parent->n_children - 1; j++) {
-              parent->children[j] = parent->children[j + 1];
-            }
-            parent->n_children--;
-            parent->children =
-                realloc(parent->children, parent->n_children * sizeof(Node));
-            break;
-          }
-        }
-        parent->selected = true;
+        delete_node(tree, selected);
+        select_node(parent);
       }
     }
     break;
   }
   case (GDK_KEY_i): {
     Node *selected = get_selected_node(tree->root);
-    if (selected != NULL) {
+    if (selected != NULL && selected->parent != NULL) {
       char *name = ask_for_name();
       if (name) {
-        Node *new_node = create_node(get_unused_id(tree->root));
-        new_node->name = strdup(name);
-        add_child(new_node, selected);
-
-        Node *parent = selected->parent;
-        if (parent != NULL) {
-          for (int i = 0; i < parent->n_children; i++) {
-            if (parent->children[i] == selected) {
-              parent->children[i] = new_node;
-              break;
-            }
-          }
+        insert_parent(tree, selected, name);
+        free(name);
+      }
+    }
+    break;
+  }
+  case (GDK_KEY_u): {
+    Node *mount = get_selected_node(tree->root);
+    while (mount != NULL && !mount->mount_loaded) {
+      mount = mount->parent;
+    }
+    if (mount != NULL) {
+      if (has_dirty_shard(mount) && !ask_yes_no("Discard changes to shard?")) {
+        break;
+      }
+      for (guint i = 0; i < views->len; i++) {
+        View *v = g_ptr_array_index(views, i);
+        if (check_if_descendent(mount, v->draw_root)) {
+          v->draw_root = mount;
         }
       }
+      select_node(mount);
+      unload_mount(tree, mount);
+    }
+    break;
+  }
+  case (GDK_KEY_x): {
+    Node *selected = get_selected_node(tree->root);
+    if (selected != NULL && selected->parent != NULL &&
+        selected->mount == NULL) {
+      char *path = ask_for_name();
+      if (path) {
+        selected->mount = path;
+        selected->mount_loaded = true;
+        selected->mount_dirty = true;
+        append_node(&loaded_mounts, selected);
+        touch_shard(selected->parent);
+      }
     }
     break;
   }
   case (GDK_KEY_Return): {
     Node *selected = get_selected_node(tree->root);
     if (selected != NULL) {
-      draw_root = selected;
+      expand_node(tree, selected);
+      view->draw_root = selected;
     }
     break;
   }
+  case (GDK_KEY_M): {
+    view->minimap_visible = !view->minimap_visible;
+    break;
+  }
   case (GDK_KEY_m): {
     slim_mode = !slim_mode;
+    layout_dirty = true;
+    break;
+  }
+  case (GDK_KEY_o): {
+    layout_style = (layout_style + 1) % N_LAYOUT_STYLES;
+    layout_dirty = true;
     break;
   }
   case (GDK_KEY_semicolon): {
-    side_panel_visible = !side_panel_visible;
+    view->side_panel_visible = !view->side_panel_visible;
+    break;
+  }
+  case (GDK_KEY_W): {
+    View *opened = open_view(tree, view->draw_root);
+    opened->zoom = view->zoom;
+    opened->x_offset = opened->target_x_offset = view->target_x_offset;
+    opened->y_offset = opened->target_y_offset = view->target_y_offset;
+    break;
+  }
+  case (GDK_KEY_plus):
+  case (GDK_KEY_equal): {
+    zoom_view(1.25);
+    break;
+  }
+  case (GDK_KEY_minus): {
+    zoom_view(1 / 1.25);
     break;
   }
   case (GDK_KEY_question): {
@@ -1052,71 +5539,64 @@ static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
     break;
   }
   case (GDK_KEY_Up): {
-    y_offset += 100;
+    view->target_y_offset += 100;
 
-    int width;
-    int height;
-    gtk_window_get_size(GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)),
-                        &width, &height);
     Node *selected = get_selected_node(tree->root);
-    if (selected != NULL) {
-      if (!is_visible(selected->rect, x_offset, y_offset, width, height)) {
-        y_offset -= 100;
-      }
+    if (selected != NULL && !view_shows(view, selected)) {
+      view->target_y_offset -= 100;
     }
     break;
   }
   case (GDK_KEY_Down): {
-    y_offset -= 100;
+    view->target_y_offset -= 100;
 
-    int width;
-    int height;
-    gtk_window_get_size(GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)),
-                        &width, &height);
     Node *selected = get_selected_node(tree->root);
-    if (selected != NULL) {
-      if (!is_visible(selected->rect, x_offset, y_offset, width, height)) {
-        y_offset += 100;
-      }
+    if (selected != NULL && !view_shows(view, selected)) {
+      view->target_y_offset += 100;
     }
     break;
   }
   case (GDK_KEY_Left): {
-    x_offset += 100;
+    view->target_x_offset += 100;
 
-    int width;
-    int height;
-    gtk_window_get_size(GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)),
-                        &width, &height);
     Node *selected = get_selected_node(tree->root);
-    if (selected != NULL) {
-      if (!is_visible(selected->rect, x_offset, y_offset, width, height)) {
-        x_offset -= 100;
-      }
+    if (selected != NULL && !view_shows(view, selected)) {
+      view->target_x_offset -= 100;
     }
     break;
   }
   case (GDK_KEY_Right): {
-    x_offset -= 100;
+    view->target_x_offset -= 100;
 
-    int width;
-    int height;
-    gtk_window_get_size(GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)),
-                        &width, &height);
+    Node *selected = get_selected_node(tree->root);
+    if (selected != NULL && !view_shows(view, selected)) {
+      view->target_x_offset += 100;
+    }
+    break;
+  }
+  case (GDK_KEY_bracketright): {
     Node *selected = get_selected_node(tree->root);
     if (selected != NULL) {
-      if (!is_visible(selected->rect, x_offset, y_offset, width, height)) {
-        x_offset += 100;
+      expand_node(tree, selected);
+      ensure_preorder(tree);
+      if (selected->preorder + 1 < preorder.len) {
+        select_node(preorder.nodes[selected->preorder + 1]);
       }
     }
     break;
   }
-  case (GDK_KEY_0): {
+  case (GDK_KEY_bracketleft): {
     Node *selected = get_selected_node(tree->root);
     if (selected != NULL) {
-      selected->selected = false;
+      ensure_preorder(tree);
+      if (selected->preorder > 0) {
+        select_node(preorder.nodes[selected->preorder - 1]);
+      }
     }
-    tree->root->selected = true;
+    break;
+  }
+  case (GDK_KEY_0): {
+    select_node(tree->root);
     break;
   }
   case (GDK_KEY_a): {
@@ -1124,26 +5604,15 @@ static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
     break;
   }
   case (GDK_KEY_slash): {
-    Node *node = node_search_dialog();
+    Node *node = node_search_dialog(tree);
     if (node != NULL) {
-      Node *selected = get_selected_node(tree->root);
-      if (selected != NULL) {
-        selected->selected = false;
-      }
-      node->selected = true;
+      select_node(node);
     }
     break;
   }
   case (GDK_KEY_space): {
-    Node *selected = get_selected_node(tree->root);
-    if (selected != NULL) {
-      selected->selected = false;
-    }
-
-    int num_nodes = count_descendents(tree->root);
-    int random = rand() % num_nodes;
-    Node *node = get_nth_node(tree->root, &random);
-    node->selected = true;
+    int num_nodes = count_descendents(tree->root) + 1;
+    select_node(get_nth_node(tree->root, rand() % num_nodes));
     break;
   }
   case (GDK_KEY_z): {
@@ -1154,13 +5623,16 @@ static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
     break;
   }
   case (GDK_KEY_s): {
-    char *s = serialize_tree(tree->root);
-    FILE *file = fopen(filename, "w");
-    fprintf(file, "%s", s);
-    fclose(file);
-
-    current_hash = hash_string(s);
-    free(s);
+    save_tree(tree);
+    break;
+  }
+  case (GDK_KEY_E): {
+    char *path = ask_for_name();
+    if (path) {
+      export_tree(tree, path);
+      free(path);
+      layout_dirty = true;
+    }
     break;
   }
   case (GDK_KEY_S): {
@@ -1169,6 +5641,12 @@ static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
     free(s);
     break;
   }
+#ifdef TRACE
+  case (GDK_KEY_T): {
+    dump_trace(TRACE_FILE);
+    break;
+  }
+#endif
   }
 
   if (event->keyval >= GDK_KEY_1 && event->keyval <= GDK_KEY_9) {
@@ -1176,59 +5654,68 @@ static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
     Node *selected = get_selected_node(tree->root);
     if (selected != NULL) {
       if (num < selected->n_children) {
-        Node *child = selected->children[num];
-        Node *current = get_selected_node(tree->root);
-        if (current != NULL) {
-          current->selected = false;
-        }
-        child->selected = true;
+        select_node(selected->children[num]);
       }
     }
   }
 
-  gtk_widget_queue_draw(drawing_area);
-
   Node *selected = get_selected_node(tree->root);
   if (selected != NULL) {
-    if (!check_if_descendent(draw_root, selected)) {
-      draw_root = selected;
+    if (!check_if_descendent(view->draw_root, selected)) {
+      view->draw_root = selected;
     }
-
-    int width;
-    int height;
-    gtk_window_get_size(GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)),
-                        &width, &height);
-    if (!is_visible(selected->rect, x_offset, y_offset, width, height)) {
+    if (!view_shows(view, selected)) {
       center_node(selected);
     }
   }
 
-  calculate_parents(tree->root);
+  unload_hidden_mounts(tree);
 
-  gtk_widget_queue_draw(drawing_area);
+  // A key that expands a node or re-roots the view changes the shared layout.
+  if (view_local_key(event->keyval) && structure_version == old_structure &&
+      view->draw_root == old_root) {
+    schedule_view(view);
+    for (guint i = 0; selected_node != old_selected && i < views->len; i++) {
+      View *v = g_ptr_array_index(views, i);
+      schedule_view_of(v, old_selected);
+      schedule_view_of(v, selected_node);
+    }
+  } else {
+    schedule_frame();
+  }
 
   return FALSE;
 }
 
+static gboolean handle_key(GtkWidget *widget, GdkEventKey *event,
+                           gpointer data) {
+  TRACE_BEGIN(start);
+  g_rec_mutex_lock(&tree_lock);
+  gboolean handled = handle_key_locked(widget, event, data);
+  g_rec_mutex_unlock(&tree_lock);
+  TRACE_END(start, "key", gdk_keyval_name(event->keyval));
+
+  return handled;
+}
+
 void draw_grid(cairo_t *cr, double line_width, double xstep, double ystep) {
   cairo_set_line_width(cr, line_width);
 
   int width;
   int height;
-  gtk_window_get_size(GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)), &width,
-                      &height);
+  view_size(view, &width, &height);
 
-  for (double x = x_offset; x < width; x += xstep) {
-    cairo_move_to(cr, x, y_offset);
+  for (double x = view->x_offset; x < width; x += xstep) {
+    cairo_move_to(cr, x, view->y_offset);
     cairo_line_to(cr, x, height);
-    cairo_stroke(cr);
   }
 
-  for (double y = y_offset; y < height; y += ystep) {
-    cairo_move_to(cr, x_offset, y);
+  for (double y = view->y_offset; y < height; y += ystep) {
+    cairo_move_to(cr, view->x_offset, y);
     cairo_line_to(cr, width, y);
-    cairo_stroke(cr);
   }
+
+  cairo_stroke(cr);
 }
 
 void draw_background(cairo_t *cr) {
@@ -1236,8 +5723,8 @@ void draw_background(cairo_t *cr) {
   cairo_paint(cr);
 
   set_color(cr, COLOR_GRID, 1.0);
-  draw_grid(cr, 1, 100, 100);
-  draw_grid(cr, 0.5, 20, 20);
+  draw_grid(cr, 1, 100 * view->zoom, 100 * view->zoom);
+  draw_grid(cr, 0.5, 20 * view->zoom, 20 * view->zoom);
 }
 
 void draw_frame(cairo_t *cr) {
@@ -1247,29 +5734,94 @@ void draw_frame(cairo_t *cr) {
 
   int width;
   int height;
-  gtk_window_get_size(GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)), &width,
-                      &height);
+  view_size(view, &width, &height);
   cairo_move_to(cr, 10, height - 10);
   char text[100];
   sprintf(text, "Frame: %d", frame);
   cairo_show_text(cr, text);
 }
 
+void draw_loading_indicator(cairo_t *cr) {
+  double progress = g_atomic_int_get(&load_permille) / 1000.0;
+
+  set_color(cr, COLOR_ACCENT, 1.0);
+  cairo_rectangle(cr, 10, 30, 200 * progress, 6);
+  cairo_fill(cr);
+
+  set_color(cr, COLOR_FOREGROUND, 1.0);
+  cairo_set_line_width(cr, 1);
+  cairo_rectangle(cr, 10, 30, 200, 6);
+  cairo_stroke(cr);
+
+  char text[100];
+  cairo_move_to(cr, 10, 20);
+  sprintf(text, "Loading %d%%", (int)(progress * 100));
+  cairo_show_text(cr, text);
+}
+
 void draw_modified_indicator(cairo_t *cr, Tree *tree) {
-  char *s = serialize_tree(tree->root);
-  if (current_hash != hash_string(s)) {
+  if (loading) {
+    draw_loading_indicator(cr);
+    return;
+  }
+
+  if (read_only) {
+    set_color(cr, COLOR_FOREGROUND, 1.0);
+    cairo_move_to(cr, 10, 20);
+    cairo_show_text(cr, "Read only");
+    return;
+  }
+
+  if (tree_modified(tree)) {
     set_color(cr, COLOR_FOREGROUND, 1.0);
     char text[100];
     cairo_move_to(cr, 10, 20);
     sprintf(text, "Modified");
     cairo_show_text(cr, text);
   }
-  free(s);
+}
+
+/*
+ * Fills lines with a summary of the memory held by nodes, interned strings
+ * and child arrays. Hash table overhead is estimated from the entry counts.
+ */
+int describe_memory(Tree *tree, char lines[][100]) {
+  double mb = 1024 * 1024;
+  gssize nodes = g_atomic_pointer_get(&live_nodes);
+  gssize children = g_atomic_pointer_get(&child_bytes);
+  gssize offsets = g_atomic_pointer_get(&offset_bytes);
+  gssize layouts = g_atomic_pointer_get(&live_layouts);
+
+  g_mutex_lock(&intern_lock);
+  gssize strings = string_bytes;
+  gssize refs = string_refs;
+  guint unique = interned != NULL ? g_hash_table_size(interned) : 0;
+  g_mutex_unlock(&intern_lock);
+
+  // Hash table entries, the preorder labels and the running totals of
+  // get_nth_node. The copy a reload keeps of the file counts too.
+  guint indexed = g_hash_table_size(tree->nodes);
+  if (reload_base != NULL) {
+    indexed += g_hash_table_size(reload_base->nodes);
+  }
+  double overhead = indexed * (2 * sizeof(gpointer) + sizeof(guint)) +
+                    unique * (sizeof(gpointer) + sizeof(guint)) +
+                    preorder.size * sizeof(Node *) + offsets;
+
+  sprintf(lines[0], "Nodes: %ld (%.1f MB)", (long)nodes,
+          nodes * sizeof(Node) / mb);
+  sprintf(lines[1], "Strings: %u unique, %ld refs (%.1f MB)", unique,
+          (long)refs, strings / mb);
+  sprintf(lines[2], "Child arrays: %.1f MB", children / mb);
+  sprintf(lines[3], "Overhead: %.1f MB", overhead / mb);
+  // Pango does not tell how much a layout holds, so only the count is known.
+  sprintf(lines[4], "Text layouts: %ld, not counted above", (long)layouts);
+  return 5;
 }
 
 void draw_side_panel(cairo_t *cr, Tree *tree, double x, double y, double width,
                      double height) {
-  if (!side_panel_visible) {
+  if (!view->side_panel_visible) {
     x += width;
   }
 
@@ -1281,12 +5833,18 @@ void draw_side_panel(cairo_t *cr, Tree *tree, double x, double y, double width,
   cairo_rectangle(cr, x, y, width, height);
   cairo_stroke(cr);
 
-  Node *selected = get_selected_node(draw_root);
+  Node *selected = get_selected_node(view->draw_root);
   if (selected != NULL) {
     char text[100];
     int offset = 20;
 
-    sprintf(text, "Node Count: %d", count_descendents(tree->root));
+    if (loading) {
+      sprintf(text, "Node Count: loading");
+    } else if (map_index != NULL) {
+      sprintf(text, "Node Count: %d", map_index->n - 1);
+    } else {
+      sprintf(text, "Node Count: %d", count_descendents(tree->root));
+    }
     cairo_move_to(cr, x + 10, y + offset);
     cairo_show_text(cr, text);
     offset += 20;
@@ -1296,10 +5854,31 @@ void draw_side_panel(cairo_t *cr, Tree *tree, double x, double y, double width,
     cairo_show_text(cr, text);
     offset += 20;
 
-    sprintf(text, "Descendents: %d", count_descendents(selected));
+    if (loading) {
+      sprintf(text, "Descendents: loading");
+    } else if (read_only) {
+      sprintf(text, "Descendents: %d expanded", count_descendents(selected));
+    } else {
+      sprintf(text, "Descendents: %d", count_descendents(selected));
+    }
     cairo_move_to(cr, x + 10, y + offset);
     cairo_show_text(cr, text);
 
+    if (count_marked() > 0) {
+      offset += 20;
+      sprintf(text, "Marked: %d", count_marked());
+      cairo_move_to(cr, x + 10, y + offset);
+      cairo_show_text(cr, text);
+    }
+
+    char memory[5][100];
+    int n_memory = describe_memory(tree, memory);
+    for (int i = 0; i < n_memory; i++) {
+      offset += 20;
+      cairo_move_to(cr, x + 10, y + offset);
+      cairo_show_text(cr, memory[i]);
+    }
+
     if (selected->filename != NULL) {
       offset += 20;
       sprintf(text, "Filename: %s", selected->filename);
@@ -1322,47 +5901,224 @@ void draw_side_panel(cairo_t *cr, Tree *tree, double x, double y, double width,
   }
 }
 
-void draw_child_node_names(cairo_t *cr) {
-  Node *selected = get_selected_node(draw_root);
-  if (selected != NULL) {
-    int offset = 60;
-    for (int i = 0; i < selected->n_children; i++) {
-      cairo_move_to(cr, 10, offset);
-      char name[100];
-      snprintf(name, 100, "%d: %s", i + 1, selected->children[i]->name);
-      cairo_show_text(cr, name);
-      offset += 20.0 / 12.0 * font_size;
-    }
+void draw_child_node_names(cairo_t *cr) {
+  Node *selected = get_selected_node(view->draw_root);
+  if (selected != NULL) {
+    int offset = 60;
+    for (int i = 0; i < selected->n_children; i++) {
+      cairo_move_to(cr, 10, offset);
+      char name[100];
+      snprintf(name, 100, "%d: %s", i + 1, selected->children[i]->name);
+      cairo_show_text(cr, name);
+      offset += 20.0 / 12.0 * font_size;
+    }
+  }
+}
+
+/*
+ * Paints one horizontal strip of the minimap, visiting only the nodes in it.
+ * Nodes are drawn as plain boxes, which is all that shows at this scale.
+ */
+void draw_minimap_strip(int strip) {
+  int width = cairo_image_surface_get_width(minimap);
+  int height = cairo_image_surface_get_height(minimap);
+  double strip_height = (double)height / MINIMAP_STRIPS;
+  Rectangle region = {
+      layout_extent.x1, layout_extent.y1 + strip * strip_height / minimap_scale,
+      layout_extent.x2,
+      layout_extent.y1 + (strip + 1) * strip_height / minimap_scale};
+
+  NodeList visible = {NULL, 0, 0};
+  NodeList connected = {NULL, 0, 0};
+  collect_visible(layout_root, NULL, region, &visible, &connected);
+
+  cairo_t *cr = cairo_create(minimap);
+  cairo_rectangle(cr, 0, strip * strip_height, width, strip_height);
+  cairo_clip(cr);
+  set_color(cr, COLOR_BACKGROUND, 1.0);
+  cairo_paint(cr);
+
+  cairo_scale(cr, minimap_scale, minimap_scale);
+  cairo_translate(cr, -layout_extent.x1, -layout_extent.y1);
+  for (int i = 0; i < visible.len; i++) {
+    Rectangle rect = visible.nodes[i]->rect;
+    cairo_rectangle(cr, rect.x1, rect.y1, rect.x2 - rect.x1, rect.y2 - rect.y1);
+  }
+  set_color(cr, COLOR_FOREGROUND, 0.8);
+  cairo_fill(cr);
+  cairo_destroy(cr);
+
+  free(visible.nodes);
+  free(connected.nodes);
+}
+
+/*
+ * Brings the cached minimap up to date with the layout. After the layout
+ * changes the image is repainted a strip at a time, as many as fit in the
+ * time budget of each frame, so a large tree never stalls a frame. Returns
+ * whether strips are left for later frames.
+ */
+bool update_minimap() {
+  if (minimap_version != layout_version || minimap_scheme != color_scheme) {
+    double width = fmax(layout_extent.x2 - layout_extent.x1, 1);
+    double height = fmax(layout_extent.y2 - layout_extent.y1, 1);
+    minimap_scale = MINIMAP_SIZE / fmax(width, height);
+    int surface_width = fmax(ceil(width * minimap_scale), 1);
+    int surface_height = fmax(ceil(height * minimap_scale), 1);
+
+    if (minimap == NULL ||
+        cairo_image_surface_get_width(minimap) != surface_width ||
+        cairo_image_surface_get_height(minimap) != surface_height) {
+      if (minimap != NULL) {
+        cairo_surface_destroy(minimap);
+      }
+      minimap = cairo_image_surface_create(CAIRO_FORMAT_RGB24, surface_width,
+                                           surface_height);
+    }
+    minimap_version = layout_version;
+    minimap_scheme = color_scheme;
+    minimap_strips_done = 0;
+  }
+
+  gint64 start = g_get_monotonic_time();
+  while (minimap_strips_done < MINIMAP_STRIPS &&
+         (minimap_strips_done == 0 ||
+          g_get_monotonic_time() - start < MINIMAP_BUDGET)) {
+    draw_minimap_strip(minimap_strips_done++);
+  }
+  return minimap_strips_done < MINIMAP_STRIPS;
+}
+
+// Where the minimap of v goes in its window: the bottom left corner.
+Rectangle minimap_box(View *v) {
+  int width;
+  int height;
+  view_size(v, &width, &height);
+  double x = 10;
+  double y = height - 30 - cairo_image_surface_get_height(minimap);
+  return (Rectangle){x, y, x + cairo_image_surface_get_width(minimap),
+                     y + cairo_image_surface_get_height(minimap)};
+}
+
+// Blits the cached minimap and outlines the part of the tree v shows.
+void draw_minimap(cairo_t *cr, View *v) {
+  Rectangle box = minimap_box(v);
+  cairo_set_source_surface(cr, minimap, box.x1, box.y1);
+  cairo_paint(cr);
+
+  set_color(cr, COLOR_FOREGROUND, 1.0);
+  cairo_set_line_width(cr, 1);
+  cairo_rectangle(cr, box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+  cairo_stroke(cr);
+
+  int width;
+  int height;
+  view_size(v, &width, &height);
+  Rectangle seen = to_layout(v, 0, 0, width, height);
+  cairo_save(cr);
+  cairo_rectangle(cr, box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+  cairo_clip(cr);
+  cairo_rectangle(cr, box.x1 + (seen.x1 - layout_extent.x1) * minimap_scale,
+                  box.y1 + (seen.y1 - layout_extent.y1) * minimap_scale,
+                  (seen.x2 - seen.x1) * minimap_scale,
+                  (seen.y2 - seen.y1) * minimap_scale);
+  set_color(cr, COLOR_ACCENT, 1.0);
+  cairo_stroke(cr);
+  cairo_restore(cr);
+}
+
+/*
+ * Centres v on the spot under a click at x, y if it hit the minimap. A spot
+ * outside the subtree v shows makes v show the whole layout instead.
+ */
+bool jump_to_minimap(View *v, double x, double y) {
+  if (!v->minimap_visible || minimap == NULL) {
+    return false;
   }
+  Rectangle box = minimap_box(v);
+  if (x < box.x1 || x > box.x2 || y < box.y1 || y > box.y2) {
+    return false;
+  }
+
+  double layout_x = layout_extent.x1 + (x - box.x1) / minimap_scale;
+  double layout_y = layout_extent.y1 + (y - box.y1) / minimap_scale;
+  Rectangle extent = v->draw_root->subtree_rect;
+  if (layout_x < extent.x1 || layout_x > extent.x2 || layout_y < extent.y1 ||
+      layout_y > extent.y2) {
+    // layout_root may be stale after a delete, so look at the views again.
+    v->draw_root = views_root();
+  }
+
+  int width;
+  int height;
+  view_size(v, &width, &height);
+  double dx;
+  double dy;
+  view_shift(v, &dx, &dy);
+  v->target_x_offset = width / 2.0 - (layout_x + dx) * v->zoom;
+  v->target_y_offset = height / 2.0 - (layout_y + dy) * v->zoom;
+  return true;
 }
 
 static gboolean handle_draw(GtkWidget *widget, cairo_t *cr, gpointer data) {
   (void)widget;
-  Tree *tree = (Tree *)data;
+  View *outer = view;
+  view = (View *)data;
+  Tree *tree = view->tree;
 
-  if (slim_mode) {
-    set_style_slim(cr);
-  } else {
-    set_style_normal(cr);
-  }
+  TRACE_BEGIN(start);
+  g_rec_mutex_lock(&tree_lock);
 
-  draw_background(cr);
+  set_style();
 
-  cairo_set_font_size(cr, font_size);
-  draw_nodes(cr, draw_root, 100, 100, 0, 0);
+  draw_background(cr);
 
   int panel_width = 600;
   int width;
   int height;
-  gtk_window_get_size(GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)), &width,
-                      &height);
+  view_size(view, &width, &height);
+
+  cairo_set_font_size(cr, font_size);
+  update_layout();
+
+  double dx;
+  double dy;
+  view_shift(view, &dx, &dy);
+  Rectangle visible = to_layout(view, 0, 0, width, height);
+  cairo_save(cr);
+  cairo_translate(cr, view->x_offset, view->y_offset);
+  cairo_scale(cr, view->zoom, view->zoom);
+  cairo_translate(cr, dx, dy);
+  draw_tree(cr, view->draw_root, visible);
+  cairo_restore(cr);
   draw_side_panel(cr, tree, width - panel_width, 10, panel_width - 10,
                   height - 20);
 
   draw_child_node_names(cr);
 
+  if (view->minimap_visible) {
+    if (update_minimap()) {
+      schedule_view(view);
+    }
+    draw_minimap(cr, view);
+  }
+
+  if (view->banding && view->dragging) {
+    cairo_rectangle(cr, view->click_pos_x, view->click_pos_y,
+                    view->mouse_x - view->click_pos_x,
+                    view->mouse_y - view->click_pos_y);
+    set_color(cr, COLOR_ACCENT_FAINT, 0.3);
+    cairo_fill_preserve(cr);
+    set_color(cr, COLOR_ACCENT, 1.0);
+    cairo_stroke(cr);
+  }
+
   draw_frame(cr);
   draw_modified_indicator(cr, tree);
+
+  g_rec_mutex_unlock(&tree_lock);
+  TRACE_END(start, "draw", NULL);
+  view = outer;
   return FALSE;
 }
 
@@ -1382,16 +6138,29 @@ Node *get_clicked_node(Node *node, double x, double y) {
   return NULL;
 }
 
+// Marks every node that intersects region.
+void mark_region(Node *root, Rectangle region) {
+  NodeList visible = {NULL, 0, 0};
+  NodeList connected = {NULL, 0, 0};
+  collect_visible(root, NULL, region, &visible, &connected);
+  for (int i = 0; i < visible.len; i++) {
+    mark_node(visible.nodes[i]);
+  }
+  free(visible.nodes);
+  free(connected.nodes);
+}
+
 static gboolean handle_click(GtkWidget *widget, GdkEventButton *event,
                              gpointer data) {
   (void)widget;
-  (void)data;
+  view = (View *)data;
 
-  mouse_x = event->x;
-  mouse_y = event->y;
-  click_pos_x = event->x;
-  click_pos_y = event->y;
-  dragging = false;
+  view->mouse_x = event->x;
+  view->mouse_y = event->y;
+  view->click_pos_x = event->x;
+  view->click_pos_y = event->y;
+  view->dragging = false;
+  view->banding = event->state & GDK_SHIFT_MASK;
 
   return FALSE;
 }
@@ -1399,23 +6168,30 @@ static gboolean handle_click(GtkWidget *widget, GdkEventButton *event,
 static gboolean handle_release(GtkWidget *widget, GdkEventButton *event,
                                gpointer data) {
   (void)widget;
-
-  Tree *tree = (Tree *)data;
-
-  if (!dragging) {
-    Node *selected = get_selected_node(tree->root);
-    if (selected != NULL) {
-      selected->selected = false;
-    }
-
-    Node *clicked =
-        get_clicked_node(tree->root, event->x - x_offset, event->y - y_offset);
-    if (clicked != NULL) {
-      clicked->selected = true;
+  view = (View *)data;
+
+  g_rec_mutex_lock(&tree_lock);
+  if (view->banding && view->dragging) {
+    Rectangle region = to_layout(view, fmin(view->click_pos_x, event->x),
+                                 fmin(view->click_pos_y, event->y),
+                                 fmax(view->click_pos_x, event->x),
+                                 fmax(view->click_pos_y, event->y));
+    mark_region(view->draw_root, region);
+  } else if (!view->dragging && !jump_to_minimap(view, event->x, event->y)) {
+    Rectangle point = to_layout(view, event->x, event->y, event->x, event->y);
+    Node *node = get_clicked_node(view->draw_root, point.x1, point.y1);
+    if (!view->banding) {
+      clear_marks();
+      select_node(node);
+    } else if (node != NULL) {
+      toggle_mark(node);
+      select_node(node);
     }
-
-    gtk_widget_queue_draw(drawing_area);
   }
+  g_rec_mutex_unlock(&tree_lock);
+
+  view->banding = false;
+  schedule_frame();
 
   return FALSE;
 }
@@ -1427,60 +6203,627 @@ double distance(double x1, double y1, double x2, double y2) {
 static gboolean handle_drag(GtkWidget *widget, GdkEventButton *event,
                             gpointer data) {
   (void)widget;
-  (void)data;
+  view = (View *)data;
 
   if (event->state & GDK_BUTTON1_MASK) {
-    x_offset += event->x - mouse_x;
-    y_offset += event->y - mouse_y;
-    mouse_x = event->x;
-    mouse_y = event->y;
+    if (!view->banding) {
+      pan_view(event->x - view->mouse_x, event->y - view->mouse_y);
+    }
+    view->mouse_x = event->x;
+    view->mouse_y = event->y;
 
-    if (distance(click_pos_x, click_pos_y, event->x, event->y) > 5) {
-      dragging = true;
+    if (distance(view->click_pos_x, view->click_pos_y, event->x, event->y) >
+        5) {
+      view->dragging = true;
     }
+    schedule_view(view);
   }
 
-  gtk_widget_queue_draw(drawing_area);
-
   return FALSE;
 }
 
-int main(int argc, char *argv[]) {
-  srand(time(NULL));
+void handle_view_destroy(GtkWidget *widget, gpointer data) {
+  (void)widget;
+  View *v = (View *)data;
 
-  if (argc > 1) {
-    filename = strdup(argv[1]);
+  // The control socket threads look at the views when they delete nodes.
+  g_rec_mutex_lock(&tree_lock);
+  g_ptr_array_remove(views, v);
+  if (view == v) {
+    view = views->len > 0 ? g_ptr_array_index(views, 0) : NULL;
   }
+  free(v);
+  g_rec_mutex_unlock(&tree_lock);
 
-  if (filename == NULL) {
-    filename = strdup("tree.txt");
+  if (views->len == 0) {
+    gtk_main_quit();
   }
+}
 
-  Tree *tree = deserialize_tree(filename);
-  calculate_parents(tree->root);
-
-  gtk_init(NULL, NULL);
+// Opens a window on tree that shows the subtree under root.
+View *open_view(Tree *tree, Node *root) {
+  View *v = calloc(1, sizeof(View));
+  v->tree = tree;
+  v->draw_root = root;
+  v->zoom = 1;
+  g_rec_mutex_lock(&tree_lock);
+  if (views == NULL) {
+    views = g_ptr_array_new();
+  }
+  g_ptr_array_add(views, v);
+  g_rec_mutex_unlock(&tree_lock);
 
   GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-  gtk_window_set_title(GTK_WINDOW(window), "Tree Editor");
+  gtk_window_set_title(GTK_WINDOW(window),
+                       read_only ? "Tree Editor (read only)" : "Tree Editor");
   gtk_window_set_default_size(GTK_WINDOW(window), 1600, 850);
 
   GtkWidget *container = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
   gtk_container_add(GTK_CONTAINER(window), container);
 
-  drawing_area = gtk_drawing_area_new();
-  gtk_container_add(GTK_CONTAINER(container), drawing_area);
-  gtk_widget_set_hexpand(drawing_area, TRUE);
-  gtk_widget_set_vexpand(drawing_area, TRUE);
+  v->drawing_area = gtk_drawing_area_new();
+  gtk_container_add(GTK_CONTAINER(container), v->drawing_area);
+  gtk_widget_set_hexpand(v->drawing_area, TRUE);
+  gtk_widget_set_vexpand(v->drawing_area, TRUE);
 
-  SIGNAL_CONNECT(window, "destroy", gtk_main_quit, NULL);
-  SIGNAL_CONNECT(drawing_area, "draw", handle_draw, tree);
-  SIGNAL_CONNECT(window, "key-press-event", handle_key, tree);
-  SIGNAL_CONNECT(window, "button-press-event", handle_click, NULL);
-  SIGNAL_CONNECT(window, "button-release-event", handle_release, tree);
-  SIGNAL_CONNECT(window, "motion-notify-event", handle_drag, tree);
+  SIGNAL_CONNECT(window, "destroy", handle_view_destroy, v);
+  SIGNAL_CONNECT(v->drawing_area, "draw", handle_draw, v);
+  SIGNAL_CONNECT(window, "key-press-event", handle_key, v);
+  SIGNAL_CONNECT(window, "button-press-event", handle_click, v);
+  SIGNAL_CONNECT(window, "button-release-event", handle_release, v);
+  SIGNAL_CONNECT(window, "motion-notify-event", handle_drag, v);
 
   gtk_widget_show_all(window);
+  return v;
+}
+
+typedef struct TreeStats {
+  int nodes;
+  int leaves;
+  int max_depth;
+  int max_children;
+  int colored;
+  int with_filename;
+} TreeStats;
+
+void collect_stats(Node *node, int depth, TreeStats *stats) {
+  stats->nodes++;
+  if (node->n_children == 0) {
+    stats->leaves++;
+  }
+  if (depth > stats->max_depth) {
+    stats->max_depth = depth;
+  }
+  if (node->n_children > stats->max_children) {
+    stats->max_children = node->n_children;
+  }
+  if (node->color != 0) {
+    stats->colored++;
+  }
+  if (node->filename != NULL) {
+    stats->with_filename++;
+  }
+
+  for (int i = 0; i < node->n_children; i++) {
+    collect_stats(node->children[i], depth + 1, stats);
+  }
+}
+
+int validate_node(Tree *tree, Node *node, GHashTable *seen) {
+  int count = 1;
+
+  if (g_hash_table_contains(seen, GINT_TO_POINTER(node->id))) {
+    printf("Duplicate id %d\n", node->id);
+    count = -1;
+  }
+  g_hash_table_add(seen, GINT_TO_POINTER(node->id));
+
+  if (find_node(tree, node->id) != node) {
+    printf("Node %d is not indexed\n", node->id);
+    count = -1;
+  }
+
+  int descendents = 0;
+  for (int i = 0; i < node->n_children; i++) {
+    Node *child = node->children[i];
+    if (child->parent != node) {
+      printf("Node %d has a wrong parent link\n", child->id);
+      count = -1;
+    }
+    if (i < node->stale_from ? child->index != i : child->index < i) {
+      printf("Node %d has index %d but is at position %d\n", child->id,
+             child->index, i);
+      count = -1;
+    }
+
+    int child_count = validate_node(tree, child, seen);
+    if (child_count < 0 || count < 0) {
+      count = -1;
+    } else {
+      descendents += child_count;
+    }
+  }
+
+  if (count > 0 && descendents != node->n_descendents) {
+    printf("Node %d counts %d descendents instead of %d\n", node->id,
+           node->n_descendents, descendents);
+    count = -1;
+  }
+
+  return count < 0 ? -1 : descendents + 1;
+}
+
+/*
+ * Checks parent links, id uniqueness and indexing, descendant counts and that
+ * the tree survives a serialize/parse round trip. Problems are printed.
+ */
+bool validate_preorder(Node *node, int *next) {
+  if (*next >= preorder.len || preorder.nodes[*next] != node ||
+      node->preorder != *next) {
+    printf("Node %d has a stale preorder label\n", node->id);
+    return false;
+  }
+  (*next)++;
+
+  for (int i = 0; i < node->n_children; i++) {
+    if (!validate_preorder(node->children[i], next)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool validate_tree(Tree *tree) {
+  GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+  bool valid = validate_node(tree, tree->root, seen) > 0;
+  if (g_hash_table_size(tree->nodes) != g_hash_table_size(seen)) {
+    printf("Index holds %d nodes but the tree has %d\n",
+           g_hash_table_size(tree->nodes), g_hash_table_size(seen));
+    valid = false;
+  }
+  g_hash_table_destroy(seen);
+
+  int next = 0;
+  ensure_preorder(tree);
+  if (!validate_preorder(tree->root, &next)) {
+    valid = false;
+  }
+
+  if (tree->root->parent != NULL) {
+    printf("Root has a parent\n");
+    valid = false;
+  }
+
+  char *s = serialize_tree(tree->root);
+  size_t len = strlen(s);
+  char *data = malloc(len + 1);
+  memcpy(data, s, len);
+  Tree *copy = parse_tree(data, len);
+  char *t = serialize_tree(copy->root);
+  if (strcmp(s, t) != 0) {
+    printf("Tree does not survive a round trip\n");
+    valid = false;
+  }
+  free(s);
+  free(t);
+  free(data);
+  free_tree(copy);
+
+  return valid;
+}
+
+void print_matches(Node *node, char *pattern) {
+  if (strstr(node->name, pattern) != NULL) {
+    printf("%d\t%s\n", node->id, node->name);
+  }
+
+  for (int i = 0; i < node->n_children; i++) {
+    print_matches(node->children[i], pattern);
+  }
+}
+
+void print_outline(Node *node, int depth) {
+  for (int i = 0; i < depth; i++) {
+    putchar('\t');
+  }
+  printf("%s\n", node->name);
+
+  for (int i = 0; i < node->n_children; i++) {
+    print_outline(node->children[i], depth + 1);
+  }
+}
+
+void print_dot_string(char *s) {
+  putchar('"');
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      putchar('\\');
+    }
+    putchar(*s);
+  }
+  putchar('"');
+}
+
+void print_dot_node(Node *node) {
+  printf("  %d [label=", node->id);
+  print_dot_string(node->name);
+  printf("];\n");
+
+  for (int i = 0; i < node->n_children; i++) {
+    printf("  %d -> %d;\n", node->id, node->children[i]->id);
+    print_dot_node(node->children[i]);
+  }
+}
+
+/*
+ * Builds a tree of n nodes where every node has fan_out children, filled
+ * breadth-first, or where every node hangs off the root if fan_out is 0.
+ */
+Tree *bench_tree(int n, int fan_out, NodeList *nodes) {
+  Tree *tree = create_tree();
+  append_node(nodes, tree->root);
+
+  for (int i = 1; i < n; i++) {
+    Node *parent = fan_out > 0 ? nodes->nodes[(i - 1) / fan_out] : tree->root;
+    char name[32];
+    sprintf(name, "Node %d", i);
+    Node *node = create_node(i, intern(name));
+    append_child(parent, node);
+    register_node(tree, node);
+    append_node(nodes, node);
+  }
+  calculate_descendents(tree->root);
+  structure_version++;
+  tree->next_id = n;
+
+  return tree;
+}
+
+/*
+ * Marks nodes on adjacent levels, X and the sibling Y of its parent P, in
+ * many groups so the marked nodes are visited in both orders. Moving them up
+ * must take X next to P and Y next to G, one level each.
+ */
+bool check_reparent_marked() {
+  Tree *tree = create_tree();
+  NodeList groups = {NULL, 0, 0};
+  for (int i = 0; i < 64; i++) {
+    Node *g = insert_child(tree, tree->root, "G");
+    Node *p = insert_child(tree, g, "P");
+    Node *y = insert_child(tree, g, "Y");
+    Node *x = insert_child(tree, p, "X");
+    mark_node(x);
+    mark_node(y);
+    append_node(&groups, g);
+  }
+
+  reparent_marked();
+
+  bool ok = true;
+  for (int i = 0; i < groups.len; i++) {
+    Node *g = groups.nodes[i];
+    if (g->n_children != 2 || g->children[1]->parent != g ||
+        strcmp(g->children[1]->name, "X") != 0 ||
+        g->children[0]->n_children != 0) {
+      ok = false;
+    }
+  }
+  if (tree->root->n_children != 2 * groups.len || !validate_tree(tree)) {
+    ok = false;
+  }
+  if (!ok) {
+    printf("Marked nodes on adjacent levels did not move up one level each\n");
+  }
+
+  clear_marks();
+  free(groups.nodes);
+  free_tree(tree);
+  return ok;
+}
+
+Node *bench_pick(NodeList *nodes) {
+  return nodes->nodes[1 + rand() % (nodes->len - 1)];
+}
+
+/*
+ * Times BENCH_OPS of each edit on trees of growing size and checks the tree
+ * after each run. An edit whose cost per operation grows by more than
+ * BENCH_GROWTH over the range of sizes is reported as super-linear.
+ *
+ * Deleting from an ordered child array shifts the siblings after it, so on
+ * the flat tree, where the fan-out grows with the tree, delete is linear per
+ * operation by design. It is only flagged when it grows faster than twice
+ * the size, which still catches a per-sibling cache miss or a realloc per
+ * removal.
+ */
+int run_bench() {
+  const char *ops[] = {"add", "move", "insert", "reparent", "delete"};
+  bool shifts_siblings[] = {false, false, false, false, true};
+  int n_ops = sizeof(ops) / sizeof(ops[0]);
+  int fan_outs[] = {2, 16, 0};
+  int sizes[] = {4000, 16000, 64000, 256000};
+  int n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  bool ok = check_reparent_marked();
+
+  srand(1);
+  printf("%-8s %8s", "fan-out", "nodes");
+  for (int op = 0; op < n_ops; op++) {
+    printf(" %9s", ops[op]);
+  }
+  printf("   (ns per operation)\n");
+
+  for (int f = 0; f < 3; f++) {
+    double first[8];
+    double last[8];
+    for (int s = 0; s < n_sizes; s++) {
+      NodeList nodes = {NULL, 0, 0};
+      Tree *tree = bench_tree(sizes[s], fan_outs[f], &nodes);
+      double ns[8];
+
+      for (int op = 0; op < n_ops; op++) {
+        NodeList targets = {NULL, 0, 0};
+        if (op == 4) {
+          for (int i = 1; i < nodes.len; i++) {
+            if (nodes.nodes[i]->n_children == 0) {
+              append_node(&targets, nodes.nodes[i]);
+            }
+          }
+          for (int i = targets.len - 1; i > 0; i--) {
+            int j = rand() % (i + 1);
+            Node *temp = targets.nodes[i];
+            targets.nodes[i] = targets.nodes[j];
+            targets.nodes[j] = temp;
+          }
+          targets.len = targets.len < BENCH_OPS ? targets.len : BENCH_OPS;
+        } else {
+          for (int i = 0; i < BENCH_OPS; i++) {
+            append_node(&targets, bench_pick(&nodes));
+          }
+        }
+
+        gint64 start = g_get_monotonic_time();
+        for (int i = 0; i < targets.len; i++) {
+          Node *node = targets.nodes[i];
+          switch (op) {
+          case 0:
+            insert_child(tree, node->parent, "Added");
+            break;
+          case 1:
+            move_sibling(node, i % 2 == 0 ? 1 : -1);
+            break;
+          case 2:
+            insert_parent(tree, node, "Inserted");
+            break;
+          case 3:
+            reparent_up(node);
+            break;
+          case 4:
+            delete_node(tree, node);
+            break;
+          }
+        }
+        gint64 elapsed = g_get_monotonic_time() - start;
+        ns[op] = targets.len > 0 ? elapsed * 1000.0 / targets.len : 0;
+        free(targets.nodes);
+      }
+
+      printf("%-8d %8d", fan_outs[f], sizes[s]);
+      for (int op = 0; op < n_ops; op++) {
+        printf(" %9.0f", ns[op]);
+        if (s == 0) {
+          first[op] = ns[op];
+        }
+        last[op] = ns[op];
+      }
+      printf("\n");
+
+      if (!validate_tree(tree)) {
+        printf("Invariants broken at fan-out %d with %d nodes\n", fan_outs[f],
+               sizes[s]);
+        ok = false;
+      }
+      free(nodes.nodes);
+      free_tree(tree);
+    }
+
+    for (int op = 0; op < n_ops; op++) {
+      double growth = last[op] / fmax(first[op], 1);
+      double limit = BENCH_GROWTH;
+      if (fan_outs[f] == 0 && shifts_siblings[op]) {
+        limit = 2.0 * sizes[n_sizes - 1] / sizes[0];
+      }
+      if (last[op] > 1000 && growth > limit) {
+        printf("Super-linear: %s at fan-out %d costs %.1fx more per "
+               "operation at %dx the nodes\n",
+               ops[op], fan_outs[f], growth, sizes[n_sizes - 1] / sizes[0]);
+        ok = false;
+      }
+    }
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void print_usage(char *program) {
+  printf("Usage: %s [-w WIDTH] [-s SOCKET] [FILE]\n"
+         "       %s [-w WIDTH] -r FILE\n"
+         "       %s [-w WIDTH] [-s SOCKET] -i PATH [FILE]\n"
+         "       %s [-w WIDTH] -c COMMAND FILE [ARG]\n"
+         "       %s -c bench\n"
+         "\n"
+         "Commands:\n"
+         "  stats           Print node statistics\n"
+         "  print           Print the tree in the native format\n"
+         "  extract ID      Print the subtree under ID as a standalone tree\n"
+         "  grep PATTERN    Print the nodes whose name contains PATTERN\n"
+         "  validate        Check the tree structure\n"
+         "  convert FORMAT  Print the tree as tree, outline or dot\n"
+         "  import          Print the directory or outline FILE as a tree\n"
+         "  export OUTPUT   Render the tree to a .png, .pdf or .svg file\n"
+         "  bench           Time edits on generated trees and check them\n"
+         "\n"
+         "With -r the file is mapped and browsed read-only, and nodes are\n"
+         "created as they are expanded. With -i the directory or outline at\n"
+         "PATH is imported, to be saved to FILE. With -w names wider than\n"
+         "WIDTH pixels are cut short with an ellipsis.\n"
+         "\n"
+         "With -s the editor takes batches of edits on the UNIX socket\n"
+         "SOCKET, one command per line and a blank line after each batch:\n"
+         "  add PARENT ID NAME, rename ID NAME, color ID COLOR,\n"
+         "  move ID PARENT [INDEX], delete ID, select ID, save\n"
+         "A batch is applied whole or not at all, and answered with\n"
+         "\"ok COUNT\" or \"error LINE: REASON\".\n",
+         program, program, program, program, program);
+}
+
+/*
+ * Runs a command against a tree file without initializing GTK. Returns the
+ * exit status of the process.
+ */
+int run_command(char *program, int argc, char *argv[]) {
+  if (argc == 1 && strcmp(argv[0], "bench") == 0) {
+    return run_bench();
+  }
+
+  if (argc < 2) {
+    print_usage(program);
+    return EXIT_FAILURE;
+  }
+
+  char *command = argv[0];
+  char *arg = argc > 2 ? argv[2] : NULL;
+  Tree *tree;
+  if (strcmp(command, "import") == 0) {
+    tree = create_tree();
+    import_path(tree, argv[1], false);
+    calculate_descendents(tree->root);
+  } else {
+    tree = deserialize_tree(argv[1]);
+  }
+
+  if (strcmp(command, "stats") == 0) {
+    TreeStats stats = {0, 0, 0, 0, 0, 0};
+    collect_stats(tree->root, 0, &stats);
+    printf("Nodes: %d\n", stats.nodes);
+    printf("Leaves: %d\n", stats.leaves);
+    printf("Depth: %d\n", stats.max_depth);
+    printf("Max children: %d\n", stats.max_children);
+    printf("Colored: %d\n", stats.colored);
+    printf("With filename: %d\n", stats.with_filename);
+
+    char memory[5][100];
+    int n_memory = describe_memory(tree, memory);
+    for (int i = 0; i < n_memory; i++) {
+      printf("%s\n", memory[i]);
+    }
+  } else if (strcmp(command, "print") == 0 || strcmp(command, "import") == 0) {
+    char *s = serialize_tree(tree->root);
+    printf("%s", s);
+    free(s);
+  } else if (strcmp(command, "extract") == 0 && arg != NULL) {
+    Node *node = find_node(tree, atoi(arg));
+    if (node == NULL) {
+      printf("Unknown node %s\n", arg);
+      return EXIT_FAILURE;
+    }
+    char *s = serialize_subtree(node);
+    printf("%s", s);
+    free(s);
+  } else if (strcmp(command, "export") == 0 && arg != NULL) {
+    if (!export_tree(tree, arg)) {
+      return EXIT_FAILURE;
+    }
+  } else if (strcmp(command, "grep") == 0 && arg != NULL) {
+    print_matches(tree->root, arg);
+  } else if (strcmp(command, "validate") == 0) {
+    if (!validate_tree(tree)) {
+      return EXIT_FAILURE;
+    }
+  } else if (strcmp(command, "convert") == 0 && arg != NULL) {
+    if (strcmp(arg, "tree") == 0) {
+      char *s = serialize_tree(tree->root);
+      printf("%s", s);
+      free(s);
+    } else if (strcmp(arg, "outline") == 0) {
+      print_outline(tree->root, 0);
+    } else if (strcmp(arg, "dot") == 0) {
+      printf("digraph tree {\n");
+      print_dot_node(tree->root);
+      printf("}\n");
+    } else {
+      printf("Unknown format: %s\n", arg);
+      return EXIT_FAILURE;
+    }
+  } else {
+    print_usage(program);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  srand(time(NULL));
+#ifdef TRACE
+  atexit(dump_trace_at_exit);
+#endif
+
+  while (argc > 2 &&
+         (strcmp(argv[1], "-w") == 0 || strcmp(argv[1], "-s") == 0)) {
+    if (strcmp(argv[1], "-s") == 0) {
+      control_path = argv[2];
+    } else {
+      max_text_width = atof(argv[2]);
+      if (max_text_width <= 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
+
+  if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+    return run_command(argv[0], argc - 2, argv + 2);
+  }
+
+  if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+    read_only = true;
+    filename = strdup(argv[2]);
+  } else if (argc > 2 && strcmp(argv[1], "-i") == 0) {
+    import_source = strdup(argv[2]);
+    if (argc > 3) {
+      filename = strdup(argv[3]);
+    }
+  } else if (argc > 1) {
+    filename = strdup(argv[1]);
+  }
+
+  if (filename == NULL) {
+    filename = strdup("tree.txt");
+  }
+
+  Tree *tree = create_tree();
+  select_node(tree->root);
+  if (read_only) {
+    open_map_index(filename);
+    fill_mapped_node(tree->root, find_map_slot(0));
+    expand_mapped(tree, tree->root);
+  } else {
+    loading = true;
+  }
+
+  gtk_init(NULL, NULL);
+  view = open_view(tree, tree->root);
+
+  if (!read_only) {
+    g_thread_unref(g_thread_new("load", load_tree_thread, tree));
+    watch_file(tree);
+  }
+  if (control_path != NULL && !open_control_socket(tree, control_path)) {
+    return EXIT_FAILURE;
+  }
 
   gtk_main();
 }